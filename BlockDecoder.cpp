@@ -216,6 +216,16 @@ std::string BlockDecoder::getNode(u8 x, u8 y, u8 z) const
 }
 
 
+int BlockDecoder::getContentId(u8 x, u8 y, u8 z) const
+{
+	unsigned int position = x + (y << 4) + (z << 8);
+	int content = readBlockContent(m_mapData.c_str(), m_version, position);
+	if (content == m_blockAirId || content == m_blockIgnoreId)
+		return -1;
+	return content;
+}
+
+
 BlockDecoder::NodeMetaData const &BlockDecoder::getNodeMetaData(u8 x, u8 y, u8 z) const
 {
 	unsigned int position = x + (y << 4) + (z << 8);
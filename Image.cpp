@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdio>
 #include <cerrno>
 #include <cstring>
@@ -7,6 +8,9 @@
 #include <gd.h>
 #include <gdfontmb.h>
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "Image.h"
 
@@ -66,6 +70,11 @@ Image::Image(int width, int height) :
 	gdImageSaveAlpha(m_image, true);
 }
 
+Image::Image(gdImagePtr image) :
+	m_width(gdImageSX(image)), m_height(gdImageSY(image)), m_image(image)
+{
+}
+
 Image::~Image()
 {
 	gdImageDestroy(m_image);
@@ -109,8 +118,13 @@ void Image::drawCircle(int x, int y, int diameter, const Color &c)
 	gdImageArc(m_image, x, y, diameter, diameter, 0, 360, color2int(c));
 }
 
-void Image::save(const std::string &filename) const
+void Image::save(const std::string &filename, const PngWriter::Options &options, bool useGd) const
 {
+	if (!useGd && filename.length() >= 4 &&
+			filename.compare(filename.length() - 4, 4, ".png") == 0) {
+		PngWriter::write(filename, m_image->tpixels, m_width, m_height, options);
+		return;
+	}
 #if (GD_MAJOR_VERSION == 2 && GD_MINOR_VERSION == 1 && GD_RELEASE_VERSION >= 1) || (GD_MAJOR_VERSION == 2 && GD_MINOR_VERSION > 1) || GD_MAJOR_VERSION > 2
 	const char *f = filename.c_str();
 	if (gdSupportsFileType(f, 1) == GD_FALSE)
@@ -130,6 +144,29 @@ void Image::save(const std::string &filename) const
 	fclose(f);
 #endif
 }
+std::string Image::png(const PngWriter::Options &options, bool useGd) const
+{
+	if (!useGd) {
+		std::ostringstream out;
+		PngWriter::write(out, m_image->tpixels, m_width, m_height, options);
+		return out.str();
+	}
+	int size;
+	void *data = gdImagePngPtr(m_image, &size);
+	if (!data)
+		throw std::runtime_error("Error encoding image");
+	std::string png(static_cast<char *>(data), size);
+	gdFree(data);
+	return png;
+}
+
+Image *Image::fromPng(const std::string &data)
+{
+	gdImagePtr image = gdImageCreateFromPngPtr(data.size(), const_cast<char *>(data.data()));
+	if (!image)
+		throw std::runtime_error("Error decoding image");
+	return new Image(image);
+}
 
 Image::Image(std::string const &fileName)
 {
@@ -152,6 +189,71 @@ void Image::scaleBlit(Image *to, int x, int y, int w, int h) const
 	gdImageCopyResampled(to->m_image, m_image, x,y, 0,0, w, h, gdImageSX(m_image),gdImageSY(m_image));
 }
 
+// Average of four gd pixels, the colors weighted by their opacity
+static inline int averageQuad(int p0, int p1, int p2, int p3)
+{
+	if (((p0 | p1 | p2 | p3) & 0x7f000000) == 0) {
+		int r = (((p0 >> 16) & 0xff) + ((p1 >> 16) & 0xff) + ((p2 >> 16) & 0xff) + ((p3 >> 16) & 0xff) + 2) >> 2;
+		int g = (((p0 >> 8) & 0xff) + ((p1 >> 8) & 0xff) + ((p2 >> 8) & 0xff) + ((p3 >> 8) & 0xff) + 2) >> 2;
+		int b = ((p0 & 0xff) + (p1 & 0xff) + (p2 & 0xff) + (p3 & 0xff) + 2) >> 2;
+		return (r << 16) | (g << 8) | b;
+	}
+	int w0 = gdAlphaMax - ((p0 >> 24) & 0x7f), w1 = gdAlphaMax - ((p1 >> 24) & 0x7f);
+	int w2 = gdAlphaMax - ((p2 >> 24) & 0x7f), w3 = gdAlphaMax - ((p3 >> 24) & 0x7f);
+	int sum = w0 + w1 + w2 + w3;
+	if (sum == 0)
+		return gdAlphaMax << 24;
+	int r = (((p0 >> 16) & 0xff) * w0 + ((p1 >> 16) & 0xff) * w1 + ((p2 >> 16) & 0xff) * w2 + ((p3 >> 16) & 0xff) * w3 + sum / 2) / sum;
+	int g = (((p0 >> 8) & 0xff) * w0 + ((p1 >> 8) & 0xff) * w1 + ((p2 >> 8) & 0xff) * w2 + ((p3 >> 8) & 0xff) * w3 + sum / 2) / sum;
+	int b = ((p0 & 0xff) * w0 + (p1 & 0xff) * w1 + (p2 & 0xff) * w2 + (p3 & 0xff) * w3 + sum / 2) / sum;
+	int a = gdAlphaMax - (sum + 2) / 4;
+	return (a << 24) | (r << 16) | (g << 8) | b;
+}
+
+void Image::downsample(Image *to, int x, int y) const
+{
+	int w = std::min(m_width / 2, to->m_width - x);
+	int h = std::min(m_height / 2, to->m_height - y);
+	for (int j = 0; j < h; ++j) {
+		const int *row0 = m_image->tpixels[2 * j];
+		const int *row1 = m_image->tpixels[2 * j + 1];
+		int *out = to->m_image->tpixels[y + j] + x;
+		int i = 0;
+#ifdef __SSE2__
+		// Four opaque pixels at a time, the channels summed as 16 bit
+		const __m128i alphaMask = _mm_set1_epi32(0x7f000000);
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i two = _mm_set1_epi16(2);
+		for (; i + 4 <= w; i += 4) {
+			__m128i a0 = _mm_loadu_si128((const __m128i *) (row0 + 2 * i));
+			__m128i b0 = _mm_loadu_si128((const __m128i *) (row0 + 2 * i + 4));
+			__m128i a1 = _mm_loadu_si128((const __m128i *) (row1 + 2 * i));
+			__m128i b1 = _mm_loadu_si128((const __m128i *) (row1 + 2 * i + 4));
+			__m128i alpha = _mm_and_si128(_mm_or_si128(_mm_or_si128(a0, b0), _mm_or_si128(a1, b1)), alphaMask);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(alpha, zero)) != 0xffff) {
+				for (int k = i; k < i + 4; ++k)
+					out[k] = averageQuad(row0[2 * k], row0[2 * k + 1], row1[2 * k], row1[2 * k + 1]);
+				continue;
+			}
+			// Lanes 0-3 hold the first pixel of each pair, 4-7 the second
+			__m128i lowA = _mm_add_epi16(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(a1, zero));
+			__m128i highA = _mm_add_epi16(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(a1, zero));
+			__m128i lowB = _mm_add_epi16(_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b1, zero));
+			__m128i highB = _mm_add_epi16(_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero));
+			lowA = _mm_add_epi16(lowA, _mm_srli_si128(lowA, 8));
+			highA = _mm_add_epi16(highA, _mm_srli_si128(highA, 8));
+			lowB = _mm_add_epi16(lowB, _mm_srli_si128(lowB, 8));
+			highB = _mm_add_epi16(highB, _mm_srli_si128(highB, 8));
+			__m128i sumA = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lowA, highA), two), 2);
+			__m128i sumB = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(lowB, highB), two), 2);
+			_mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(sumA, sumB));
+		}
+#endif
+		for (; i < w; ++i)
+			out[i] = averageQuad(row0[2 * i], row0[2 * i + 1], row1[2 * i], row1[2 * i + 1]);
+	}
+}
+
 void Image::fill(const Color &c, bool setAlpha)
 {
 	if (setAlpha)
@@ -166,6 +268,33 @@ void Image::fill(const Color &c, bool setAlpha)
 }
 
 
+Image *Image::clone() const
+{
+	Image *copy = new Image(m_width, m_height);
+	for (int y = 0; y < m_height; ++y)
+		memcpy(copy->m_image->tpixels[y], m_image->tpixels[y], m_width * sizeof(int));
+	return copy;
+}
+
+bool Image::samePixels(const Image &other) const
+{
+	if (other.m_width != m_width || other.m_height != m_height)
+		return false;
+	for (int y = 0; y < m_height; ++y) {
+		if (gdImageTrueColor(other.m_image)) {
+			if (memcmp(other.m_image->tpixels[y], m_image->tpixels[y], m_width * sizeof(int)) != 0)
+				return false;
+			continue;
+		}
+		for (int x = 0; x < m_width; ++x) {
+			if (gdImageGetTrueColorPixel(other.m_image, x, y) != m_image->tpixels[y][x])
+				return false;
+		}
+	}
+	return true;
+}
+
+
 void Image::blit(Image *to, int x, int y)
 {
 	gdImageCopy(to->m_image, m_image, x, y, 0,0, m_width, m_height);
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+
+#include "NodeFinder.h"
+#include "util.h"
+
+// Blocks waiting to be searched, they are small enough
+#define NODEFINDER_QUEUE 256
+
+NodeFinder::NodeFinder(std::ostream &out):
+	m_out(out),
+	m_xMin(-2048), m_xMax(2048), m_zMin(-2048), m_zMax(2048),
+	m_yMin(-30000), m_yMax(30000),
+	m_blocksSearched(0),
+	m_blocksRejected(0),
+	m_nodesFound(0)
+#if __cplusplus >= 201103L
+	, m_busy(0), m_stop(false)
+#else
+	, m_blk(true)
+#endif
+{
+}
+
+NodeFinder::~NodeFinder()
+{
+#if __cplusplus >= 201103L
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_queued.notify_all();
+	for (size_t i = 0; i < m_threads.size(); ++i)
+		m_threads[i].join();
+#endif
+}
+
+void NodeFinder::addName(const std::string &name)
+{
+	m_names.insert(name);
+}
+
+void NodeFinder::setArea(int xMin, int xMax, int zMin, int zMax, int yMin, int yMax)
+{
+	m_xMin = xMin;
+	m_xMax = xMax;
+	m_zMin = zMin;
+	m_zMax = zMax;
+	m_yMin = yMin;
+	m_yMax = yMax;
+}
+
+void NodeFinder::visit(const BlockPos &pos, const ustring &data)
+{
+	if (pos.x < m_xMin || pos.x >= m_xMax || pos.z < m_zMin || pos.z >= m_zMax)
+		return;
+	if (pos.y * 16 + 15 < m_yMin || pos.y * 16 > m_yMax)
+		return;
+
+#if __cplusplus >= 201103L
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_threads.empty()) {
+		size_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+		for (size_t i = 0; i < numThreads; ++i)
+			m_threads.push_back(std::thread(&NodeFinder::run, this));
+	}
+	m_done.wait(lock, [this]() { return m_blocks.size() < NODEFINDER_QUEUE; });
+	m_blocks.push_back(Block(pos, data));
+	lock.unlock();
+	m_queued.notify_one();
+#else
+	std::string lines;
+	size_t found = 0;
+	bool searched = search(m_blk, Block(pos, data), lines, found);
+	report(searched, lines, found);
+#endif
+}
+
+void NodeFinder::finish()
+{
+#if __cplusplus >= 201103L
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this]() { return m_blocks.empty() && m_busy == 0; });
+	if (!m_error.empty()) {
+		std::string error = m_error;
+		m_error.clear();
+		throw std::runtime_error(error);
+	}
+#endif
+	m_out.flush();
+}
+
+bool NodeFinder::search(BlockDecoder &blk, const Block &block, std::string &lines, size_t &found)
+{
+	blk.reset();
+	blk.decode(block.second);
+
+	// Content ids of the names in this block, usually none or a few
+	std::vector<std::pair<int, const std::string *> > ids;
+	const BlockDecoder::NameMap &nameMap = blk.getNameMap();
+	for (BlockDecoder::NameMap::const_iterator it = nameMap.begin(); it != nameMap.end(); ++it) {
+		std::set<std::string>::const_iterator name = m_names.find(it->second);
+		if (name != m_names.end())
+			ids.push_back(std::make_pair(it->first, &*name));
+	}
+	if (ids.empty())
+		return false;
+
+	const BlockPos &pos = block.first;
+	std::ostringstream out;
+	for (int y = 0; y < 16; ++y) {
+		int nodeY = pos.y * 16 + y;
+		if (nodeY < m_yMin || nodeY > m_yMax)
+			continue;
+		for (int z = 0; z < 16; ++z) {
+			for (int x = 0; x < 16; ++x) {
+				int content = blk.getContentId(x, y, z);
+				if (content < 0)
+					continue;
+				size_t i = 0;
+				while (i < ids.size() && ids[i].first != content)
+					++i;
+				if (i == ids.size())
+					continue;
+
+				BlockDecoder::NodeMetaData const &nm = blk.getNodeMetaData(x, y, z);
+				out << "{\"name\": " << json_string(*ids[i].second) << ", \"pos\": ["
+					<< (pos.x * 16 + x) << ", " << nodeY << ", " << (pos.z * 16 + z) << "], \"metadata\": {";
+				for (BlockDecoder::NodeMetaData::const_iterator m = nm.begin(); m != nm.end(); ++m)
+					out << (m == nm.begin() ? "" : ", ") << json_string(m->first) << ": " << json_string(m->second);
+				out << "}}\n";
+				found++;
+			}
+		}
+	}
+	lines = out.str();
+	return true;
+}
+
+void NodeFinder::report(bool searched, const std::string &lines, size_t found)
+{
+	if (searched)
+		m_blocksSearched++;
+	else
+		m_blocksRejected++;
+	if (!found)
+		return;
+	m_nodesFound += found;
+	// Whoever reads along sees each block as soon as it's done
+	m_out << lines;
+	m_out.flush();
+}
+
+#if __cplusplus >= 201103L
+void NodeFinder::run()
+{
+	BlockDecoder blk(true);
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_queued.wait(lock, [this]() { return m_stop || !m_blocks.empty(); });
+		if (m_stop)
+			return;
+		Block block;
+		block.swap(m_blocks.front());
+		m_blocks.pop_front();
+		m_busy++;
+		lock.unlock();
+		m_done.notify_all();
+
+		std::string lines, error;
+		size_t found = 0;
+		bool searched = false;
+		try {
+			searched = search(blk, block, lines, found);
+		} catch (std::exception &e) {
+			error = e.what();
+		}
+
+		lock.lock();
+		if (error.empty())
+			report(searched, lines, found);
+		else if (m_error.empty())
+			m_error = error;
+		m_busy--;
+		m_done.notify_all();
+	}
+}
+#endif
@@ -0,0 +1,554 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <stdint.h>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <thread>
+#include <unordered_map>
+#else
+#include <map>
+#endif
+#include <zlib.h>
+
+#include "PngWriter.h"
+
+// Uncompressed bytes deflated as one piece. Pieces are compressed
+// independently, with the end of the previous piece as dictionary.
+#define PNG_PIECE_SIZE (256 * 1024)
+#define PNG_WINDOW_SIZE 32768
+
+#define PNG_COLOR_RGB 2
+#define PNG_COLOR_PALETTE 3
+#define PNG_COLOR_RGBA 6
+
+#define PNG_FILTER_NONE 0
+#define PNG_FILTER_SUB 1
+#define PNG_FILTER_UP 2
+#define PNG_FILTER_AVERAGE 3
+#define PNG_FILTER_PAETH 4
+
+static inline void writeU32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+namespace {
+
+#if __cplusplus >= 201103L
+typedef std::unordered_map<int, unsigned long> ColorCount;
+typedef std::unordered_map<int, unsigned char> ColorIndex;
+#else
+typedef std::map<int, unsigned long> ColorCount;
+typedef std::map<int, unsigned char> ColorIndex;
+#endif
+
+static inline int channel(int color, int c)
+{
+	return (color >> (16 - 8 * c)) & 0xff;
+}
+
+// Colors [begin, end) of the list being reduced, and their widest channel
+struct ColorBox {
+	size_t begin, end;
+	int channel;
+	int range;
+};
+
+struct ChannelLess {
+	ChannelLess(int c): c(c) {}
+	bool operator()(const std::pair<int, unsigned long> &a, const std::pair<int, unsigned long> &b) const {
+		return channel(a.first, c) < channel(b.first, c);
+	}
+	int c;
+};
+
+static ColorBox measureBox(const std::vector<std::pair<int, unsigned long> > &colors, size_t begin, size_t end)
+{
+	int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+	for (size_t i = begin; i < end; ++i) {
+		for (int c = 0; c < 3; ++c) {
+			lo[c] = std::min(lo[c], channel(colors[i].first, c));
+			hi[c] = std::max(hi[c], channel(colors[i].first, c));
+		}
+	}
+	ColorBox box;
+	box.begin = begin;
+	box.end = end;
+	box.channel = 0;
+	for (int c = 1; c < 3; ++c) {
+		if (hi[c] - lo[c] > hi[box.channel] - lo[box.channel])
+			box.channel = c;
+	}
+	box.range = hi[box.channel] - lo[box.channel];
+	return box;
+}
+
+static unsigned char nearestColor(const std::vector<int> &palette, int color)
+{
+	size_t best = 0;
+	long bestDistance = -1;
+	for (size_t i = 0; i < palette.size(); ++i) {
+		long distance = 0;
+		for (int c = 0; c < 3; ++c) {
+			long d = channel(palette[i], c) - channel(color, c);
+			distance += d * d;
+		}
+		if (bestDistance < 0 || distance < bestDistance) {
+			best = i;
+			bestDistance = distance;
+		}
+	}
+	return best;
+}
+
+// Maps up to 256 colors to their palette index
+class Palette {
+public:
+	Palette(): m_size(0) {
+		memset(m_used, 0, sizeof(m_used));
+	}
+
+	// false if the color doesn't fit anymore
+	bool insert(int color) {
+		unsigned int i = slot(color);
+		if (m_used[i])
+			return true;
+		if (m_size == 256)
+			return false;
+		m_used[i] = true;
+		m_keys[i] = color;
+		m_index[i] = m_size;
+		m_colors[m_size++] = color;
+		return true;
+	}
+
+	// Only adds color to the written palette, index() won't find it
+	void append(int color) {
+		m_colors[m_size++] = color;
+	}
+
+	inline unsigned char index(int color) const {
+		return m_index[slot(color)];
+	}
+
+	int size() const { return m_size; }
+	int color(int i) const { return m_colors[i]; }
+
+private:
+	inline unsigned int slot(int color) const {
+		unsigned int i = ((uint32_t) color * 2654435761U) >> 22;
+		while (m_used[i] && m_keys[i] != color)
+			i = (i + 1) & 1023;
+		return i;
+	}
+
+	int m_size;
+	int m_colors[256];
+	bool m_used[1024];
+	int m_keys[1024];
+	unsigned char m_index[1024];
+};
+
+struct Encoder {
+	const int *const *rows;
+	int width, height;
+	int colorType;
+	int bpp; // bytes per pixel
+	size_t rowBytes; // without the filter type byte
+	int level;
+	bool adaptive;
+	Palette palette;
+	bool quantized; // pixels are looked up in nearest, not in palette
+	ColorIndex nearest;
+
+	// Convert a row of gd pixels to PNG samples
+	void convertRow(int y, unsigned char *out) const {
+		const int *row = rows[y];
+		if (colorType == PNG_COLOR_PALETTE && quantized) {
+			int previous = row[0];
+			unsigned char index = nearest.find(previous)->second;
+			for (int x = 0; x < width; ++x) {
+				if (row[x] != previous) {
+					previous = row[x];
+					index = nearest.find(previous)->second;
+				}
+				out[x] = index;
+			}
+			return;
+		}
+		if (colorType == PNG_COLOR_PALETTE) {
+			for (int x = 0; x < width; ++x)
+				out[x] = palette.index(row[x]);
+			return;
+		}
+		for (int x = 0; x < width; ++x) {
+			int px = row[x];
+			*out++ = (px >> 16) & 0xff;
+			*out++ = (px >> 8) & 0xff;
+			*out++ = px & 0xff;
+			if (colorType == PNG_COLOR_RGBA) {
+				int a = (px >> 24) & 0x7f;
+				*out++ = 255 - ((a << 1) + (a >> 6));
+			}
+		}
+	}
+
+	// Filter row y into out (1 + rowBytes), cur and prev hold the samples
+	// of row y and y - 1, prev is NULL for the first row
+	void filterRow(const unsigned char *cur, const unsigned char *prev,
+			unsigned char *out, std::vector<unsigned char> &scratch) const {
+		if (colorType == PNG_COLOR_PALETTE) {
+			out[0] = PNG_FILTER_NONE;
+			memcpy(out + 1, cur, rowBytes);
+			return;
+		}
+		if (!adaptive) {
+			out[0] = PNG_FILTER_SUB;
+			applyFilter(PNG_FILTER_SUB, cur, prev, out + 1);
+			return;
+		}
+		// The usual heuristic: the filter with the smallest sum of
+		// absolute values, seen as signed bytes
+		unsigned long best = ~0UL;
+		for (int filter = PNG_FILTER_NONE; filter <= PNG_FILTER_PAETH; ++filter) {
+			unsigned char *candidate = &scratch[0];
+			applyFilter(filter, cur, prev, candidate);
+			unsigned long sum = 0;
+			for (size_t i = 0; i < rowBytes; ++i)
+				sum += candidate[i] < 128 ? candidate[i] : 256 - candidate[i];
+			if (sum < best) {
+				best = sum;
+				out[0] = filter;
+				memcpy(out + 1, candidate, rowBytes);
+			}
+		}
+	}
+
+	void applyFilter(int filter, const unsigned char *cur, const unsigned char *prev,
+			unsigned char *out) const {
+		size_t left = std::min((size_t) bpp, rowBytes);
+		if (!prev) {
+			// Up is None, Average and Paeth only look left in the first row
+			if (filter == PNG_FILTER_NONE || filter == PNG_FILTER_UP) {
+				memcpy(out, cur, rowBytes);
+				return;
+			}
+			memcpy(out, cur, left);
+			for (size_t i = left; i < rowBytes; ++i)
+				out[i] = cur[i] - (filter == PNG_FILTER_AVERAGE ? cur[i - bpp] / 2 : cur[i - bpp]);
+			return;
+		}
+		switch (filter) {
+			case PNG_FILTER_NONE:
+				memcpy(out, cur, rowBytes);
+				break;
+			case PNG_FILTER_SUB:
+				memcpy(out, cur, left);
+				for (size_t i = left; i < rowBytes; ++i)
+					out[i] = cur[i] - cur[i - bpp];
+				break;
+			case PNG_FILTER_UP:
+				for (size_t i = 0; i < rowBytes; ++i)
+					out[i] = cur[i] - prev[i];
+				break;
+			case PNG_FILTER_AVERAGE:
+				for (size_t i = 0; i < left; ++i)
+					out[i] = cur[i] - prev[i] / 2;
+				for (size_t i = left; i < rowBytes; ++i)
+					out[i] = cur[i] - (cur[i - bpp] + prev[i]) / 2;
+				break;
+			case PNG_FILTER_PAETH:
+				for (size_t i = 0; i < left; ++i)
+					out[i] = cur[i] - prev[i];
+				for (size_t i = left; i < rowBytes; ++i) {
+					int a = cur[i - bpp], b = prev[i], c = prev[i - bpp];
+					int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+					out[i] = cur[i] - ((pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c));
+				}
+				break;
+		}
+	}
+
+	// Filtered data of rows [first, last)
+	void filterRows(int first, int last, std::vector<unsigned char> &out) const {
+		std::vector<unsigned char> prev(rowBytes), cur(rowBytes), scratch(rowBytes);
+		out.resize((last - first) * (rowBytes + 1));
+		if (first > 0)
+			convertRow(first - 1, &prev[0]);
+		for (int y = first; y < last; ++y) {
+			convertRow(y, &cur[0]);
+			filterRow(&cur[0], y > 0 ? &prev[0] : NULL,
+				&out[(y - first) * (rowBytes + 1)], scratch);
+			prev.swap(cur);
+		}
+	}
+};
+
+struct Piece {
+	int firstRow, lastRow;
+	std::vector<unsigned char> data; // compressed
+	uLong adler;
+	uLong length;
+	bool failed;
+};
+
+static void compressPiece(const Encoder &encoder, Piece &piece, bool last)
+{
+	std::vector<unsigned char> filtered;
+	encoder.filterRows(piece.firstRow, piece.lastRow, filtered);
+	piece.length = filtered.size();
+	piece.adler = adler32(adler32(0L, Z_NULL, 0), &filtered[0], filtered.size());
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	int strategy = encoder.colorType == PNG_COLOR_PALETTE ? Z_DEFAULT_STRATEGY : Z_FILTERED;
+	if (deflateInit2(&stream, encoder.level, Z_DEFLATED, -15, 9, strategy) != Z_OK) {
+		piece.failed = true;
+		return;
+	}
+	if (piece.firstRow > 0) {
+		// Refilter the end of the previous piece instead of waiting for it
+		int rows = PNG_WINDOW_SIZE / (encoder.rowBytes + 1) + 1;
+		std::vector<unsigned char> window;
+		encoder.filterRows(std::max(0, piece.firstRow - rows), piece.firstRow, window);
+		size_t size = std::min(window.size(), (size_t) PNG_WINDOW_SIZE);
+		deflateSetDictionary(&stream, &window[window.size() - size], size);
+	}
+
+	piece.data.resize(deflateBound(&stream, filtered.size()) + 16);
+	stream.next_in = &filtered[0];
+	stream.avail_in = filtered.size();
+	stream.next_out = &piece.data[0];
+	stream.avail_out = piece.data.size();
+	// A sync flush ends on a byte boundary, so the pieces can be concatenated
+	int ret = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+	piece.failed = last ? ret != Z_STREAM_END : (ret != Z_OK || stream.avail_in != 0);
+	piece.data.resize(stream.total_out);
+	deflateEnd(&stream);
+}
+
+static void writeChunk(std::ostream &out, const char *type, const unsigned char *data, size_t size)
+{
+	unsigned char header[8];
+	writeU32(header, size);
+	memcpy(header + 4, type, 4);
+	uLong crc = crc32(0L, Z_NULL, 0);
+	crc = crc32(crc, header + 4, 4);
+	if (size > 0)
+		crc = crc32(crc, data, size);
+	unsigned char footer[4];
+	writeU32(footer, crc);
+
+	out.write(reinterpret_cast<char *>(header), sizeof(header));
+	if (size > 0)
+		out.write(reinterpret_cast<const char *>(data), size);
+	out.write(reinterpret_cast<char *>(footer), sizeof(footer));
+}
+
+}
+
+std::vector<int> PngWriter::reduceColors(std::vector<std::pair<int, unsigned long> > colors,
+	size_t maxColors)
+{
+	std::vector<ColorBox> boxes;
+	if (!colors.empty() && maxColors > 0)
+		boxes.push_back(measureBox(colors, 0, colors.size()));
+	while (boxes.size() < maxColors) {
+		// Split the box with the widest channel at its weighted median
+		size_t widest = boxes.size();
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			if (boxes[i].range > 0 && (widest == boxes.size() || boxes[i].range > boxes[widest].range))
+				widest = i;
+		}
+		if (widest == boxes.size())
+			break;
+		ColorBox box = boxes[widest];
+		std::sort(colors.begin() + box.begin, colors.begin() + box.end, ChannelLess(box.channel));
+		uint64_t total = 0;
+		for (size_t i = box.begin; i < box.end; ++i)
+			total += colors[i].second;
+		size_t split = box.begin + 1;
+		uint64_t below = colors[box.begin].second;
+		while (split < box.end - 1 && below + colors[split].second <= total / 2)
+			below += colors[split++].second;
+		boxes[widest] = measureBox(colors, box.begin, split);
+		boxes.push_back(measureBox(colors, split, box.end));
+	}
+
+	std::vector<int> result;
+	for (size_t i = 0; i < boxes.size(); ++i) {
+		uint64_t sum[3] = { 0, 0, 0 }, weight = 0;
+		for (size_t j = boxes[i].begin; j < boxes[i].end; ++j) {
+			uint64_t w = std::max(colors[j].second, 1UL);
+			for (int c = 0; c < 3; ++c)
+				sum[c] += channel(colors[j].first, c) * w;
+			weight += w;
+		}
+		int color = 0;
+		for (int c = 0; c < 3; ++c)
+			color = (color << 8) | (int) ((sum[c] + weight / 2) / weight);
+		result.push_back(color);
+	}
+	return result;
+}
+
+void PngWriter::write(const std::string &fileName, const int *const *rows,
+	int width, int height, const Options &options)
+{
+	std::ofstream out(fileName.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		throw std::runtime_error("Error opening image file: " + fileName);
+	write(out, rows, width, height, options);
+	out.close();
+	if (out.fail())
+		throw std::runtime_error("Error saving image");
+}
+
+void PngWriter::write(std::ostream &out, const int *const *rows,
+	int width, int height, const Options &options)
+{
+	Preset preset = options.preset;
+	Encoder encoder;
+	encoder.rows = rows;
+	encoder.width = width;
+	encoder.height = height;
+	encoder.level = preset == FAST ? 1 : preset == SMALL ? 9 : 6;
+	encoder.adaptive = preset != FAST;
+	encoder.quantized = false;
+
+	// Pick the smallest color type that holds every pixel
+	bool alpha = false, paletted = true;
+	for (int y = 0; y < height && !alpha; ++y) {
+		const int *row = rows[y];
+		int previous = row[0];
+		paletted = paletted && encoder.palette.insert(previous);
+		for (int x = 0; x < width; ++x) {
+			if (row[x] & 0x7f000000) {
+				alpha = true;
+				break;
+			}
+			if (paletted && row[x] != previous) {
+				previous = row[x];
+				paletted = encoder.palette.insert(previous);
+			}
+		}
+	}
+	if (!alpha && (options.palette == SHARED || (options.palette == PER_IMAGE && !paletted))) {
+		ColorCount counts;
+		for (int y = 0; y < height; ++y) {
+			const int *row = rows[y];
+			for (int x = 0; x < width; ) {
+				int start = x;
+				while (x < width && row[x] == row[start])
+					++x;
+				counts[row[start]] += x - start;
+			}
+		}
+		std::vector<int> colors;
+		if (options.palette == SHARED) {
+			if (options.sharedPalette.empty() || options.sharedPalette.size() > 256)
+				throw std::runtime_error("Shared palette must have 1 to 256 colors");
+			colors = options.sharedPalette;
+		} else {
+			colors = reduceColors(std::vector<std::pair<int, unsigned long> >(counts.begin(), counts.end()), 256);
+		}
+		// Duplicates are written, so the indices stay those of colors
+		encoder.palette = Palette();
+		for (size_t i = 0; i < colors.size(); ++i)
+			encoder.palette.append(colors[i]);
+		for (ColorCount::const_iterator it = counts.begin(); it != counts.end(); ++it)
+			encoder.nearest[it->first] = nearestColor(colors, it->first);
+		encoder.quantized = true;
+		paletted = true;
+	}
+	if (alpha) {
+		encoder.colorType = PNG_COLOR_RGBA;
+		encoder.bpp = 4;
+	} else if (paletted) {
+		encoder.colorType = PNG_COLOR_PALETTE;
+		encoder.bpp = 1;
+	} else {
+		encoder.colorType = PNG_COLOR_RGB;
+		encoder.bpp = 3;
+	}
+	encoder.rowBytes = (size_t) width * encoder.bpp;
+
+	std::vector<Piece> pieces;
+	int rowsPerPiece = std::max(1, (int) (PNG_PIECE_SIZE / (encoder.rowBytes + 1)));
+	for (int y = 0; y < height; y += rowsPerPiece) {
+		Piece piece;
+		piece.firstRow = y;
+		piece.lastRow = std::min(height, y + rowsPerPiece);
+		piece.adler = 1;
+		piece.length = 0;
+		piece.failed = false;
+		pieces.push_back(piece);
+	}
+
+#if __cplusplus >= 201103L
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < pieces.size(); i = next++)
+			compressPiece(encoder, pieces[i], i + 1 == pieces.size());
+	};
+	size_t numThreads = std::min<size_t>(std::thread::hardware_concurrency(), pieces.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numThreads; ++i)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+#else
+	for (size_t i = 0; i < pieces.size(); ++i)
+		compressPiece(encoder, pieces[i], i + 1 == pieces.size());
+#endif
+	for (size_t i = 0; i < pieces.size(); ++i) {
+		if (pieces[i].failed)
+			throw std::runtime_error("Error compressing image");
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	out.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+
+	unsigned char ihdr[13];
+	writeU32(ihdr, width);
+	writeU32(ihdr + 4, height);
+	ihdr[8] = 8; // bit depth
+	ihdr[9] = encoder.colorType;
+	ihdr[10] = 0; // deflate
+	ihdr[11] = 0; // adaptive filtering
+	ihdr[12] = 0; // not interlaced
+	writeChunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+	if (encoder.colorType == PNG_COLOR_PALETTE) {
+		std::vector<unsigned char> plte;
+		for (int i = 0; i < encoder.palette.size(); ++i) {
+			int color = encoder.palette.color(i);
+			plte.push_back((color >> 16) & 0xff);
+			plte.push_back((color >> 8) & 0xff);
+			plte.push_back(color & 0xff);
+		}
+		writeChunk(out, "PLTE", &plte[0], plte.size());
+	}
+
+	// zlib header, the pieces as IDAT chunks, then the combined checksum
+	unsigned char zlibHeader[2] = { 0x78, (unsigned char) (preset == FAST ? 0x01 : preset == SMALL ? 0xda : 0x9c) };
+	writeChunk(out, "IDAT", zlibHeader, sizeof(zlibHeader));
+	uLong adler = adler32(0L, Z_NULL, 0);
+	for (size_t i = 0; i < pieces.size(); ++i) {
+		writeChunk(out, "IDAT", &pieces[i].data[0], pieces[i].data.size());
+		adler = adler32_combine(adler, pieces[i].adler, pieces[i].length);
+	}
+	unsigned char zlibFooter[4];
+	writeU32(zlibFooter, adler);
+	writeChunk(out, "IDAT", zlibFooter, sizeof(zlibFooter));
+	writeChunk(out, "IEND", NULL, 0);
+}
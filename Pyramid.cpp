@@ -0,0 +1,431 @@
+#include <assert.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "Pyramid.h"
+#include "util.h"
+
+int pyramidMaxLevel(int numTilesX, int numTilesY, int minTileX, int minTileY)
+{
+	int maxDim = numTilesX + minTileX;
+
+	maxDim = -minTileX > maxDim ? -minTileX : maxDim;
+
+	maxDim = numTilesY + minTileY > maxDim ? numTilesY - minTileY : maxDim;
+
+	maxDim = -minTileY > maxDim ? -minTileY : maxDim;
+
+	assert(maxDim >0);
+
+	int maxLevel = 0;
+	// round up to power of 2
+	for (int i = 0; i < 62 ; i++)
+	{
+		if ((1 << i) >= maxDim)
+		{
+			maxLevel = i;
+			break;
+		}
+	}
+	return maxLevel;
+}
+
+std::string pyramidTileName(std::string const &out, int level, int minTileX, int minTileY,
+	int divisor, bool leafletMode)
+{
+	std::ostringstream of;
+	of << level << "_" <<  (minTileX / divisor) << "_" << ((leafletMode ? -1 : 1) * minTileY/divisor - (leafletMode ? 1 : 0)) << "_" << out;
+	return of.str();
+}
+
+std::string pyramidTileName(std::string const &out, const TileKey &key)
+{
+	std::ostringstream of;
+	of << key.level << "_" << key.x << "_" << key.y << "_" << out;
+	return of.str();
+}
+
+TileKey pyramidTileKey(int level, int minTileX, int minTileY, int divisor)
+{
+	return TileKey(level, minTileX / divisor, -minTileY / divisor - 1);
+}
+
+bool validTileLayout(std::string const &layout)
+{
+	return layout.find("{z}") != std::string::npos && layout.find("{x}") != std::string::npos &&
+		layout.find("{y}") != std::string::npos;
+}
+
+std::string layoutTileName(std::string const &layout, const TileKey &key)
+{
+	std::ostringstream name;
+	for (size_t i = 0; i < layout.size(); i++) {
+		if (layout.compare(i, 3, "{z}") == 0)
+			name << key.level;
+		else if (layout.compare(i, 3, "{x}") == 0)
+			name << key.x;
+		else if (layout.compare(i, 3, "{y}") == 0)
+			name << key.y;
+		else {
+			name << layout[i];
+			continue;
+		}
+		i += 2;
+	}
+	return name.str();
+}
+
+static inline int floorMultiple(int value, int size)
+{
+	return (value >= 0 ? value : value - size + 1) / size * size;
+}
+
+std::string tileIndexName(std::string const &output)
+{
+	return output + ".tiles.js";
+}
+
+static std::string base64(const std::vector<unsigned char> &data)
+{
+	static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < data.size(); i += 3) {
+		unsigned value = data[i] << 16;
+		if (i + 1 < data.size())
+			value |= data[i + 1] << 8;
+		if (i + 2 < data.size())
+			value |= data[i + 2];
+		out += digits[(value >> 18) & 63];
+		out += digits[(value >> 12) & 63];
+		out += i + 1 < data.size() ? digits[(value >> 6) & 63] : '=';
+		out += i + 2 < data.size() ? digits[value & 63] : '=';
+	}
+	return out;
+}
+
+void writeTileIndex(std::string const &output, int maxLevel, const std::vector<std::pair<int, int> > &tiles)
+{
+	int maxDim = 1 << maxLevel;
+	std::ostringstream js;
+	js << "var tileIndex = {\"levels\": [\n";
+	for (int level = 0; level <= maxLevel; level++) {
+		int size = maxDim >> level;
+		std::vector<TileKey> keys;
+		int minX = INT_MAX, minY = INT_MAX, maxX = INT_MIN, maxY = INT_MIN;
+		for (size_t i = 0; i < tiles.size(); i++) {
+			int x = tiles[i].first, y = tiles[i].second;
+			if (x < -maxDim || x >= maxDim || y < -maxDim || y >= maxDim)
+				continue;
+			TileKey key = pyramidTileKey(level, floorMultiple(x, size), floorMultiple(y, size), size);
+			keys.push_back(key);
+			minX = std::min(minX, key.x);
+			minY = std::min(minY, key.y);
+			maxX = std::max(maxX, key.x);
+			maxY = std::max(maxY, key.y);
+		}
+		int w = keys.empty() ? 0 : maxX - minX + 1;
+		int h = keys.empty() ? 0 : maxY - minY + 1;
+		// One bit per tile of the bounding box, row by row
+		std::vector<unsigned char> bits(((size_t) w * h + 7) / 8);
+		for (size_t i = 0; i < keys.size(); i++) {
+			size_t bit = (size_t) (keys[i].y - minY) * w + (keys[i].x - minX);
+			bits[bit >> 3] |= 1 << (bit & 7);
+		}
+		js << "\t{\"x\": " << (w ? minX : 0) << ", \"y\": " << (h ? minY : 0) << ", \"w\": " << w << ", \"h\": " << h
+			<< ", \"bits\": \"" << base64(bits) << "\"}" << (level < maxLevel ? "," : "") << "\n";
+	}
+	js << "]};\n";
+
+	std::string fileName = tileIndexName(output);
+	std::ofstream out(fileName.c_str());
+	out << js.str();
+	out.close();
+	if (out.fail())
+		std::cerr << "Warning: could not write to '" << fileName << "'!" << std::endl;
+}
+
+std::string markerIndexName(std::string const &dir)
+{
+	return dir + "/index.js";
+}
+
+std::string markerChunkName(std::string const &dir, const TileKey &key)
+{
+	std::ostringstream name;
+	name << dir << "/" << key.x << "_" << key.y << ".json";
+	return name.str();
+}
+
+void writeMarkerIndex(std::string const &dir, int level, const std::map<std::pair<int, int>, int> &chunks)
+{
+	std::string fileName = markerIndexName(dir);
+	create_parent_dirs(fileName);
+	std::ofstream out(fileName.c_str());
+	out << "var markerIndex = {\"dir\": \"" << dir << "\", \"level\": " << level << ", \"chunks\": {";
+	for (std::map<std::pair<int, int>, int>::const_iterator it = chunks.begin(); it != chunks.end(); ++it)
+		out << (it == chunks.begin() ? "\n" : ",\n") << "\t\"" << it->first.first << "_" << it->first.second << "\": " << it->second;
+	out << "\n}};\n";
+	out.close();
+	if (out.fail())
+		std::cerr << "Warning: could not write to '" << fileName << "'!" << std::endl;
+}
+
+static char const *leafletMapHtml =
+"<!DOCTYPE html>\n"
+"<html>\n"
+"<head>\n"
+"\t<title>MinetestMapper</title>\n"
+"\t<meta charset=\"utf-8\" />\n"
+"\t<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
+"\t<!-- link rel=\"shortcut icon\" type=\"image/x-icon\" href=\"favicon.ico\" /-->\n"
+"\t<link rel=\"stylesheet\" href=\"leaflet.css\" integrity=\"sha512-puBpdR0798OZvTTbP4A8Ix/l+A4dHDD0DGqYW6RQ+9jxkRFclaxxQb/SJAWZfWAkuyeQUytO7+7N4QKrDh+drA==\" crossorigin=\"\"/>\n"
+"\t<script src=\"leaflet.js\" integrity=\"sha512-nMMmRyTVoLYqjP9hrbed9S+FzjZHW5gY1TWCHA5ckwXZBadntCNs8kEqAWdrb9O7rxbCaA4lKTIWjDXZxflOcA==\" crossorigin=\"\"></script>\n"
+"\t<script src=\"%s\"></script>\n"
+"%s"
+"\t<style> .labelclass{position: absolute; background: rgba(255,0,255,0); font-size:20px;}</style>\n"
+"</head>\n"
+"<body>\n"
+"<div id=\"mapid\" style=\"width: 90vw; height: 90vh;\"></div>\n"
+"<script>\n"
+"\tvar MineTestMap = L.map('mapid', {\n"
+"\tcrs: L.CRS.Simple,\n"
+"\t});\n"
+"\tMineTestMap.setView([0.0, 0.0], %d);\n"
+"\t// Tiles that tileIndex doesn't list aren't requested at all\n"
+"\tif (typeof tileIndex !== 'undefined') {\n"
+"\t\tfor (var z = 0; z < tileIndex.levels.length; z++)\n"
+"\t\t\ttileIndex.levels[z].data = atob(tileIndex.levels[z].bits);\n"
+"\t}\n"
+"\tfunction hasTile(c) {\n"
+"\t\tvar l = tileIndex.levels[c.z];\n"
+"\t\tif (!l)\n"
+"\t\t\treturn false;\n"
+"\t\tvar x = c.x - l.x, y = c.y - l.y;\n"
+"\t\tif (x < 0 || y < 0 || x >= l.w || y >= l.h)\n"
+"\t\t\treturn false;\n"
+"\t\tvar i = y * l.w + x;\n"
+"\t\treturn (l.data.charCodeAt(i >> 3) >> (i & 7)) & 1;\n"
+"\t}\n"
+"\tvar IndexedTileLayer = L.TileLayer.extend({\n"
+"\t\tcreateTile: function(coords, done) {\n"
+"\t\t\tif (typeof tileIndex === 'undefined' || hasTile(coords))\n"
+"\t\t\t\treturn L.TileLayer.prototype.createTile.call(this, coords, done);\n"
+"\t\t\tvar tile = document.createElement('div');\n"
+"\t\t\tsetTimeout(function() { done(null, tile); }, 0);\n"
+"\t\t\treturn tile;\n"
+"\t\t}\n"
+"\t});\n"
+"\tnew IndexedTileLayer('%s', {\n"
+"\t\tminNativeZoom: 0,\n"
+"\t\tmaxNativeZoom: %d,\n"
+"\t\tattribution: 'Minetest World',\n"
+"\t\ttileSize: %d,\n"
+"\t\terrorTileUrl: \"empty_tile_%s\",\n"
+"\t\t}).addTo(MineTestMap);\n"
+"\tvar popup = L.popup();\n"
+"\tvar mapZoom = %f;\n"
+"\tfunction onMapClick(e) {\n"
+"\t\tvar scaledPos = L.latLng(e.latlng.lat / mapZoom, e.latlng.lng / mapZoom);\n"
+"\t\tpopup\n"
+"\t\t\t.setLatLng(e.latlng)\n"
+"\t\t\t.setContent(\"You clicked the map at \"+ scaledPos.toString())\n"
+"\t\t\t.openOn(MineTestMap);\n"
+"\t}\n"
+"\tMineTestMap.on('click', onMapClick);\n"
+"\t// The markers of a tile are fetched when it comes into view\n"
+"\tif (typeof markerIndex !== 'undefined') {\n"
+"\t\tvar markerLayer = L.layerGroup().addTo(MineTestMap);\n"
+"\t\tvar loadedChunks = {};\n"
+"\t\tvar MarkerChunkLayer = L.GridLayer.extend({\n"
+"\t\t\tcreateTile: function(coords) {\n"
+"\t\t\t\tvar chunk = coords.x + '_' + coords.y;\n"
+"\t\t\t\tif (markerIndex.chunks[chunk] && !loadedChunks[chunk]) {\n"
+"\t\t\t\t\tloadedChunks[chunk] = true;\n"
+"\t\t\t\t\tfetch(markerIndex.dir + '/' + chunk + '.json')\n"
+"\t\t\t\t\t\t.then(function(response) { return response.json(); })\n"
+"\t\t\t\t\t\t.then(function(data) { L.geoJSON(data, {\n"
+"\t\t\t\t\t\t\tcoordsToLatLng: function(c) { return L.latLng((c[1] + 0.5) * mapZoom, (c[0] + 0.5) * mapZoom); },\n"
+"\t\t\t\t\t\t\tonEachFeature: function(feature, layer) {\n"
+"\t\t\t\t\t\t\t\tvar text = document.createElement('pre');\n"
+"\t\t\t\t\t\t\t\ttext.textContent = feature.properties.name + ' ' + feature.geometry.coordinates.join(' ');\n"
+"\t\t\t\t\t\t\t\tfor (var field in feature.properties.metadata)\n"
+"\t\t\t\t\t\t\t\t\ttext.textContent += '\\n' + field + ': ' + feature.properties.metadata[field];\n"
+"\t\t\t\t\t\t\t\tlayer.bindPopup(text);\n"
+"\t\t\t\t\t\t\t}\n"
+"\t\t\t\t\t\t}).addTo(markerLayer); });\n"
+"\t\t\t\t}\n"
+"\t\t\t\treturn document.createElement('div');\n"
+"\t\t\t}\n"
+"\t\t});\n"
+"\t\tnew MarkerChunkLayer({\n"
+"\t\t\ttileSize: %d,\n"
+"\t\t\tminNativeZoom: markerIndex.level,\n"
+"\t\t\tmaxNativeZoom: markerIndex.level,\n"
+"\t\t\tminZoom: Math.max(0, markerIndex.level - 2),\n"
+"\t\t}).addTo(MineTestMap);\n"
+"\t}\n"
+"</script>\n"
+"<script src=\"markers.js\" defer></script>"
+"</body>\n"
+"</html>\n";
+
+
+std::string defaultTileUrl(std::string const &output)
+{
+	return "{z}_{x}_{y}_" + output;
+}
+
+void outputLeafletCode(std::string const &output, int maxLevel, int tileSize,
+	std::string const &tileUrl, std::string const &markerDir)
+{
+
+
+	std::ostringstream fn;
+	fn << output << ".html";
+
+	// I use fopen instead of ostr because I need fprintf to put the correct values into the
+	// html static string above. ostream is nice and C++ and all, but formatted output handling
+	// for streams is retarded. Use the best tool for the job.
+	FILE *out = fopen(fn.str().c_str(), "w");
+
+	if (!out)
+	{
+		std::cout << "error opening file:" << fn.str() << std::endl;
+		return;
+	}
+
+	std::string markerScript;
+	if (!markerDir.empty())
+		markerScript = "\t<script src=\"" + markerIndexName(markerDir) + "\"></script>\n";
+	fprintf(out, leafletMapHtml, tileIndexName(output).c_str(), markerScript.c_str(), maxLevel, tileUrl.c_str(), maxLevel, tileSize, output.c_str(), 1.0/pow(2,maxLevel), tileSize);
+
+	fclose(out);
+}
+
+std::string tileListName(std::string const &baseName)
+{
+	return "tiles_" + baseName + ".txt";
+}
+
+void writeTileList(std::string const &fileName, std::vector<std::pair<int, int> > tiles)
+{
+	std::sort(tiles.begin(), tiles.end());
+	std::ofstream out(fileName.c_str());
+	out << "TileList: " << tiles.size() << "\n";
+	for (size_t i = 0; i < tiles.size(); ++i)
+		out << tiles[i].first << " " << tiles[i].second << "\n";
+	out.close();
+	if (out.fail()) {
+		std::cerr << "Warning: could not write to '" << fileName << "'!" << std::endl;
+		remove(fileName.c_str());
+	}
+}
+
+bool readTileList(std::string const &fileName, std::vector<std::pair<int, int> > &tiles)
+{
+	std::ifstream in(fileName.c_str());
+	std::string label;
+	size_t count;
+	if (!(in >> label >> count) || label != "TileList:")
+		return false;
+	tiles.clear();
+	int x, y;
+	while (tiles.size() < count && in >> x >> y)
+		tiles.push_back(std::make_pair(x, y));
+	return tiles.size() == count;
+}
+
+
+PyramidBuilder::PyramidBuilder(int tileSize, int maxLevel,
+	const std::vector<std::pair<int, int> > &tiles) :
+	m_tileSize(tileSize),
+	m_maxLevel(maxLevel),
+	m_maxDim(1 << maxLevel)
+{
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		int x = tiles[i].first, y = tiles[i].second;
+		// buildpyramid doesn't look outside the quadrants either
+		if (x < -m_maxDim || x >= m_maxDim || y < -m_maxDim || y >= m_maxDim)
+			continue;
+		for (int level = m_maxLevel; level >= 0; --level)
+			m_nodes[key(level, x, y)].expected++;
+	}
+}
+
+PyramidBuilder::~PyramidBuilder()
+{
+	for (NodeMap::iterator it = m_nodes.begin(); it != m_nodes.end(); ++it)
+		delete it->second.image;
+}
+
+PyramidBuilder::NodeMap::key_type PyramidBuilder::key(int level, int tileX, int tileY) const
+{
+	int size = m_maxDim >> level;
+	return std::make_pair(level, std::make_pair(floorMultiple(tileX, size), floorMultiple(tileY, size)));
+}
+
+PyramidBuilder::Node &PyramidBuilder::node(const NodeMap::key_type &k)
+{
+	Node &n = m_nodes[k];
+	if (!n.image) {
+		n.image = new Image(m_tileSize, m_tileSize);
+		n.image->fill(Color(0, 0, 0, 0), true);
+	}
+	return n;
+}
+
+void PyramidBuilder::addTile(int tileX, int tileY, Image &tile, Finished &finished)
+{
+	NodeMap::key_type k = key(m_maxLevel, tileX, tileY);
+	if (m_nodes.find(k) == m_nodes.end())
+		return;
+	Node &leaf = node(k);
+	tile.blit(leaf.image, 0, 0);
+	leaf.added = 1;
+	complete(m_nodes.find(k), finished);
+}
+
+void PyramidBuilder::complete(NodeMap::iterator it, Finished &finished)
+{
+	int level = it->first.first;
+	int minTileX = it->first.second.first, minTileY = it->first.second.second;
+	Node done = it->second;
+	m_nodes.erase(it);
+
+	if (level > 0) {
+		// Same quadrants as buildPyramid(), larger y at the top
+		NodeMap::key_type pk = key(level - 1, minTileX, minTileY);
+		Node &parent = node(pk);
+		int half = m_tileSize / 2;
+		bool right = minTileX != pk.second.first, top = minTileY != pk.second.second;
+		done.image->downsample(parent.image, right ? half : 0, top ? 0 : half);
+		parent.added += done.added;
+		finished.push_back(std::make_pair(pyramidTileKey(level, minTileX, minTileY,
+			m_maxDim >> level), done.image));
+		if (parent.added == parent.expected)
+			complete(m_nodes.find(pk), finished);
+	} else {
+		finished.push_back(std::make_pair(pyramidTileKey(level, minTileX, minTileY,
+			m_maxDim), done.image));
+	}
+}
+
+void PyramidBuilder::finish(Finished &finished)
+{
+	// Deepest first, so every parent has all the tiles it will get
+	while (!m_nodes.empty()) {
+		NodeMap::iterator last = m_nodes.end();
+		--last;
+		if (last->second.added == 0) {
+			m_nodes.erase(last);
+			continue;
+		}
+		last->second.expected = last->second.added;
+		complete(last, finished);
+	}
+}
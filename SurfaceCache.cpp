@@ -0,0 +1,167 @@
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <zlib.h>
+
+#include "SurfaceCache.h"
+
+#define SURFACECACHE_MAGIC "MTSC"
+#define SURFACECACHE_VERSION 1
+#define PIXEL_SIZE 10
+
+static inline void writeU16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline uint16_t readU16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline void writeU32(unsigned char *p, uint32_t v)
+{
+	writeU16(p, v >> 16);
+	writeU16(p + 2, v);
+}
+
+static inline uint32_t readU32(const unsigned char *p)
+{
+	return (uint32_t) readU16(p) << 16 | readU16(p + 2);
+}
+
+static inline void writeU64(unsigned char *p, uint64_t v)
+{
+	writeU32(p, v >> 32);
+	writeU32(p + 4, v);
+}
+
+static inline uint64_t readU64(const unsigned char *p)
+{
+	return (uint64_t) readU32(p) << 32 | readU32(p + 4);
+}
+
+SurfaceCache::SurfaceCache()
+{
+}
+
+bool SurfaceCache::load(const std::string &fileName, uint64_t settings)
+{
+	m_columns.clear();
+
+	std::ifstream in(fileName.c_str(), std::ios::binary);
+	if (!in.is_open())
+		return false;
+
+	unsigned char header[16];
+	in.read(reinterpret_cast<char *>(header), sizeof(header));
+	if (!in.good() || std::string(reinterpret_cast<char *>(header), 4) != SURFACECACHE_MAGIC ||
+			readU32(header + 4) != SURFACECACHE_VERSION || readU64(header + 8) != settings)
+		return false; // different settings give different columns
+
+	unsigned char entry[17];
+	while (in.read(reinterpret_cast<char *>(entry), sizeof(entry))) {
+		Entry e;
+		e.fingerprint = readU64(entry + 4);
+		e.numBlocks = readU16(entry + 12);
+		e.covered = entry[14];
+		uint16_t size = readU16(entry + 15);
+		e.pixels.resize(size);
+		if (!in.read(reinterpret_cast<char *>(&e.pixels[0]), size))
+			break;
+		m_columns[std::make_pair((int16_t) readU16(entry), (int16_t) readU16(entry + 2))] = e;
+	}
+	return true;
+}
+
+void SurfaceCache::save(const std::string &fileName, uint64_t settings) const
+{
+	std::ofstream out(fileName.c_str(), std::ios::binary);
+	if (!out.is_open()) {
+		std::cerr << "Warning: could not write to '" << fileName << "'!" << std::endl;
+		return;
+	}
+
+	unsigned char header[16];
+	std::copy(SURFACECACHE_MAGIC, SURFACECACHE_MAGIC + 4, header);
+	writeU32(header + 4, SURFACECACHE_VERSION);
+	writeU64(header + 8, settings);
+	out.write(reinterpret_cast<char *>(header), sizeof(header));
+
+	for (ColumnMap::const_iterator it = m_columns.begin(); it != m_columns.end(); ++it) {
+		const Entry &e = it->second;
+		unsigned char entry[17];
+		writeU16(entry, it->first.first);
+		writeU16(entry + 2, it->first.second);
+		writeU64(entry + 4, e.fingerprint);
+		writeU16(entry + 12, e.numBlocks);
+		entry[14] = e.covered;
+		writeU16(entry + 15, e.pixels.size());
+		out.write(reinterpret_cast<char *>(entry), sizeof(entry));
+		out.write(reinterpret_cast<const char *>(e.pixels.data()), e.pixels.size());
+	}
+}
+
+bool SurfaceCache::has(int16_t x, int16_t z) const
+{
+	return m_columns.find(std::make_pair(x, z)) != m_columns.end();
+}
+
+bool SurfaceCache::get(int16_t x, int16_t z, Column &column) const
+{
+	ColumnMap::const_iterator it = m_columns.find(std::make_pair(x, z));
+	if (it == m_columns.end())
+		return false;
+
+	const Entry &e = it->second;
+	unsigned char data[16 * 16 * PIXEL_SIZE];
+	uLongf size = sizeof(data);
+	if (uncompress(data, &size, e.pixels.data(), e.pixels.size()) != Z_OK || size != sizeof(data))
+		return false;
+
+	column.fingerprint = e.fingerprint;
+	column.numBlocks = e.numBlocks;
+	column.covered = e.covered;
+	const unsigned char *p = data;
+	for (int z = 0; z < 16; ++z) {
+		for (int x = 0; x < 16; ++x, p += PIXEL_SIZE) {
+			Pixel &px = column.pixels[z][x];
+			px.color = Color(p[0], p[1], p[2], p[3]);
+			px.height = (int32_t) readU32(p + 4);
+			px.thickness = p[8];
+			px.flags = p[9];
+		}
+	}
+	return true;
+}
+
+void SurfaceCache::put(int16_t x, int16_t z, const Column &column)
+{
+	unsigned char data[16 * 16 * PIXEL_SIZE];
+	unsigned char *p = data;
+	for (int z = 0; z < 16; ++z) {
+		for (int x = 0; x < 16; ++x, p += PIXEL_SIZE) {
+			const Pixel &px = column.pixels[z][x];
+			p[0] = px.color.r;
+			p[1] = px.color.g;
+			p[2] = px.color.b;
+			p[3] = px.color.a;
+			writeU32(p + 4, px.height);
+			p[8] = px.thickness;
+			p[9] = px.flags;
+		}
+	}
+
+	unsigned char compressed[16 * 16 * PIXEL_SIZE + 64];
+	uLongf size = sizeof(compressed);
+	if (compress(compressed, &size, data, sizeof(data)) != Z_OK)
+		throw std::runtime_error("Failed to compress surface cache entry");
+
+	Entry &e = m_columns[std::make_pair(x, z)];
+	e.fingerprint = column.fingerprint;
+	e.numBlocks = column.numBlocks;
+	e.covered = column.covered;
+	e.pixels = ustring(compressed, size);
+}
@@ -0,0 +1,275 @@
+#include <iostream>
+#include <stdexcept>
+
+#include "TileContainer.h"
+#include "util.h"
+
+#define SQLRES(f, good) \
+	result = (sqlite3_##f);\
+	if (result != good) {\
+		throw std::runtime_error(sqlite3_errmsg(db));\
+	}
+#define SQLOK(f) SQLRES(f, SQLITE_OK)
+
+#if __cplusplus >= 201103L
+#define LOCK std::lock_guard<std::mutex> lock(m_mutex)
+#else
+#define LOCK do {} while (0)
+#endif
+
+static const char *schema =
+	"CREATE TABLE IF NOT EXISTS metadata (name TEXT PRIMARY KEY, value TEXT);"
+	"CREATE TABLE IF NOT EXISTS images (tile_id INTEGER PRIMARY KEY, tile_data BLOB);"
+	"CREATE TABLE IF NOT EXISTS map (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER,"
+		" tile_id INTEGER, PRIMARY KEY (zoom_level, tile_column, tile_row));"
+	"CREATE VIEW IF NOT EXISTS tiles AS SELECT zoom_level, tile_column, tile_row, tile_data"
+		" FROM map JOIN images ON images.tile_id = map.tile_id;";
+
+TileContainer::TileContainer(const std::string &fileName, bool readOnly) :
+	db(NULL),
+	m_readOnly(readOnly),
+	m_dropped(false)
+{
+	int result;
+	result = sqlite3_open_v2(fileName.c_str(), &db, readOnly ? SQLITE_OPEN_READONLY :
+		SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, 0);
+	if (result != SQLITE_OK) {
+		std::string error = "Error opening tile container " + fileName + ": " + sqlite3_errmsg(db);
+		sqlite3_close(db);
+		throw std::runtime_error(error);
+	}
+	// Readers wait for a commit instead of failing
+	sqlite3_busy_timeout(db, 10000);
+
+	if (!readOnly) {
+		SQLOK(exec(db, schema, NULL, NULL, NULL))
+		SQLOK(exec(db, "BEGIN", NULL, NULL, NULL))
+	}
+
+	SQLOK(prepare_v2(db,
+			"SELECT tile_id FROM map WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+		-1, &stmt_find_tile, NULL))
+
+	SQLOK(prepare_v2(db,
+			"INSERT OR REPLACE INTO map (zoom_level, tile_column, tile_row, tile_id) VALUES (?, ?, ?, ?)",
+		-1, &stmt_set_tile, NULL))
+
+	SQLOK(prepare_v2(db,
+			"DELETE FROM map WHERE zoom_level = ? AND tile_column = ? AND tile_row = ?",
+		-1, &stmt_remove_tile, NULL))
+
+	SQLOK(prepare_v2(db,
+			"SELECT tile_data FROM images WHERE tile_id = ?",
+		-1, &stmt_get_image, NULL))
+
+	SQLOK(prepare_v2(db,
+			"INSERT INTO images (tile_id, tile_data) VALUES (?, ?)",
+		-1, &stmt_put_image, NULL))
+
+	SQLOK(prepare_v2(db,
+			"SELECT tile_column, tile_row, tile_id FROM map WHERE zoom_level = ?",
+		-1, &stmt_list_tiles, NULL))
+
+	SQLOK(prepare_v2(db,
+			"INSERT OR REPLACE INTO metadata (name, value) VALUES (?, ?)",
+		-1, &stmt_set_metadata, NULL))
+}
+
+TileContainer::~TileContainer()
+{
+	if (!m_readOnly) {
+		try {
+			commit();
+		} catch (std::exception &e) {
+			std::cerr << "Error saving tile container: " << e.what() << std::endl;
+		}
+		sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+	}
+
+	sqlite3_finalize(stmt_find_tile);
+	sqlite3_finalize(stmt_set_tile);
+	sqlite3_finalize(stmt_remove_tile);
+	sqlite3_finalize(stmt_get_image);
+	sqlite3_finalize(stmt_put_image);
+	sqlite3_finalize(stmt_list_tiles);
+	sqlite3_finalize(stmt_set_metadata);
+
+	if (sqlite3_close(db) != SQLITE_OK) {
+		std::cerr << "Error closing tile container." << std::endl;
+	};
+}
+
+void TileContainer::step(sqlite3_stmt *stmt)
+{
+	int result;
+	SQLRES(step(stmt), SQLITE_DONE)
+	sqlite3_reset(stmt);
+}
+
+bool TileContainer::find(const TileKey &key, int64_t &id)
+{
+	int result;
+	sqlite3_reset(stmt_find_tile);
+	SQLOK(bind_int(stmt_find_tile, 1, key.level));
+	SQLOK(bind_int(stmt_find_tile, 2, key.x));
+	SQLOK(bind_int(stmt_find_tile, 3, key.y));
+	result = sqlite3_step(stmt_find_tile);
+	if (result == SQLITE_ROW)
+		id = sqlite3_column_int64(stmt_find_tile, 0);
+	else if (result != SQLITE_DONE)
+		throw std::runtime_error(sqlite3_errmsg(db));
+	sqlite3_reset(stmt_find_tile);
+	return result == SQLITE_ROW;
+}
+
+void TileContainer::setTile(const TileKey &key, int64_t id)
+{
+	int result;
+	int64_t old;
+	if (find(key, old)) {
+		if (old == id)
+			return;
+		m_dropped = true;
+	}
+	sqlite3_reset(stmt_set_tile);
+	SQLOK(bind_int(stmt_set_tile, 1, key.level));
+	SQLOK(bind_int(stmt_set_tile, 2, key.x));
+	SQLOK(bind_int(stmt_set_tile, 3, key.y));
+	SQLOK(bind_int64(stmt_set_tile, 4, id));
+	step(stmt_set_tile);
+}
+
+int64_t TileContainer::storeImage(const std::string &png)
+{
+	int result;
+	// The hash of the data, or the next free id after it if a different
+	// image has that already
+	int64_t id = hash_data(png.data(), png.size());
+	while (true) {
+		sqlite3_reset(stmt_get_image);
+		SQLOK(bind_int64(stmt_get_image, 1, id));
+		result = sqlite3_step(stmt_get_image);
+		if (result == SQLITE_DONE)
+			break;
+		if (result != SQLITE_ROW)
+			throw std::runtime_error(sqlite3_errmsg(db));
+		const char *data = static_cast<const char *>(sqlite3_column_blob(stmt_get_image, 0));
+		size_t size = sqlite3_column_bytes(stmt_get_image, 0);
+		bool same = png.compare(0, std::string::npos, data, size) == 0;
+		sqlite3_reset(stmt_get_image);
+		if (same)
+			return id;
+		id++;
+	}
+	sqlite3_reset(stmt_get_image);
+
+	sqlite3_reset(stmt_put_image);
+	SQLOK(bind_int64(stmt_put_image, 1, id));
+	SQLOK(bind_blob(stmt_put_image, 2, png.data(), png.size(), SQLITE_STATIC));
+	step(stmt_put_image);
+	return id;
+}
+
+void TileContainer::put(const TileKey &key, const std::string &png)
+{
+	LOCK;
+	setTile(key, storeImage(png));
+}
+
+void TileContainer::link(const TileKey &target, const TileKey &key)
+{
+	LOCK;
+	int64_t id;
+	if (!find(target, id))
+		throw std::runtime_error("Tile to link to is not in the container");
+	setTile(key, id);
+}
+
+bool TileContainer::get(const TileKey &key, std::string &png)
+{
+	LOCK;
+	int result;
+	int64_t id;
+	if (!find(key, id))
+		return false;
+	sqlite3_reset(stmt_get_image);
+	SQLOK(bind_int64(stmt_get_image, 1, id));
+	result = sqlite3_step(stmt_get_image);
+	if (result == SQLITE_ROW)
+		png.assign(static_cast<const char *>(sqlite3_column_blob(stmt_get_image, 0)),
+			sqlite3_column_bytes(stmt_get_image, 0));
+	else if (result != SQLITE_DONE)
+		throw std::runtime_error(sqlite3_errmsg(db));
+	sqlite3_reset(stmt_get_image);
+	return result == SQLITE_ROW;
+}
+
+bool TileContainer::contains(const TileKey &key)
+{
+	int64_t id;
+	return imageId(key, id);
+}
+
+bool TileContainer::imageId(const TileKey &key, int64_t &id)
+{
+	LOCK;
+	return find(key, id);
+}
+
+void TileContainer::remove(const TileKey &key)
+{
+	LOCK;
+	int result;
+	sqlite3_reset(stmt_remove_tile);
+	SQLOK(bind_int(stmt_remove_tile, 1, key.level));
+	SQLOK(bind_int(stmt_remove_tile, 2, key.x));
+	SQLOK(bind_int(stmt_remove_tile, 3, key.y));
+	step(stmt_remove_tile);
+	m_dropped = true;
+}
+
+std::vector<std::pair<std::pair<int, int>, int64_t> > TileContainer::tiles(int level)
+{
+	LOCK;
+	int result;
+	std::vector<std::pair<std::pair<int, int>, int64_t> > tiles;
+	sqlite3_reset(stmt_list_tiles);
+	SQLOK(bind_int(stmt_list_tiles, 1, level));
+	while ((result = sqlite3_step(stmt_list_tiles)) == SQLITE_ROW) {
+		std::pair<int, int> xy(sqlite3_column_int(stmt_list_tiles, 0), sqlite3_column_int(stmt_list_tiles, 1));
+		tiles.push_back(std::make_pair(xy, sqlite3_column_int64(stmt_list_tiles, 2)));
+	}
+	sqlite3_reset(stmt_list_tiles);
+	if (result != SQLITE_DONE)
+		throw std::runtime_error(sqlite3_errmsg(db));
+	return tiles;
+}
+
+void TileContainer::setMetadata(const std::string &name, const std::string &value)
+{
+	LOCK;
+	int result;
+	sqlite3_reset(stmt_set_metadata);
+	SQLOK(bind_text(stmt_set_metadata, 1, name.c_str(), name.size(), SQLITE_TRANSIENT));
+	SQLOK(bind_text(stmt_set_metadata, 2, value.c_str(), value.size(), SQLITE_TRANSIENT));
+	step(stmt_set_metadata);
+}
+
+void TileContainer::commit()
+{
+	LOCK;
+	int result;
+	if (m_readOnly)
+		return;
+	// Images no tile shows anymore
+	if (m_dropped) {
+		SQLOK(exec(db, "DELETE FROM images WHERE tile_id NOT IN (SELECT tile_id FROM map)", NULL, NULL, NULL))
+		m_dropped = false;
+	}
+	SQLOK(exec(db, "COMMIT", NULL, NULL, NULL))
+	SQLOK(exec(db, "BEGIN", NULL, NULL, NULL))
+}
+
+#undef LOCK
+#undef SQLRES
+#undef SQLOK
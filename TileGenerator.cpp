@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <climits>
@@ -13,8 +14,10 @@
 #include "config.h"
 #include "PlayerAttributes.h"
 #include "BlockDecoder.h"
+#include "NodeFinder.h"
 #include "util.h"
 #include "db-sqlite3.h"
+#include "db-dump.h"
 #if USE_POSTGRESQL
 #include "db-postgresql.h"
 #endif
@@ -27,6 +30,13 @@
 
 using namespace std;
 
+// Blocks with identical content (ocean, stone, air above ground...) are
+// decoded only once while they stay among the most recently used ones
+#define DECODE_MEMO_SIZE 4096
+
+// Size in block columns of the tiles --fullscan collects the surface in
+#define SCAN_TILE_SIZE 16
+
 template<typename T>
 static inline T mymax(T a, T b)
 {
@@ -81,6 +91,15 @@ TileGenerator::TileGenerator():
 	m_drawAlpha(false),
 	m_shading(true),
 	m_dontWriteEmpty(false),
+	m_incremental(false),
+	m_trustSurfaceCache(false),
+	m_printStatistics(false),
+	m_fullScan(false),
+	m_useGd(false),
+	m_dedup(false),
+	m_useContainer(false),
+	m_container(NULL),
+	m_tileLevel(0),
 	m_backend(""),
 	m_xBorder(0),
 	m_yBorder(0),
@@ -99,7 +118,11 @@ TileGenerator::TileGenerator():
 	m_tileW(INT_MAX),
 	m_tileH(INT_MAX),
 	m_zoom(1),
-	m_scales(SCALE_LEFT | SCALE_TOP)
+	m_scales(SCALE_LEFT | SCALE_TOP),
+	m_fingerprint(0),
+	m_blocksDecoded(0),
+	m_blocksReused(0),
+	m_blocksSkipped(0)
 {
 }
 
@@ -239,16 +262,108 @@ void TileGenerator::printGeometry(const std::string &input)
 
 }
 
+void TileGenerator::findNodes(const std::string &input)
+{
+	if (m_markers.empty())
+		throw std::runtime_error("--find needs the nodes to look for, give them with --marker");
+
+	string input_path = input;
+	if (input_path[input.length() - 1] != PATH_SEPARATOR) {
+		input_path += PATH_SEPARATOR;
+	}
+
+	openDb(input_path);
+	NodeFinder finder(cout);
+	for (NameSet::const_iterator it = m_markers.begin(); it != m_markers.end(); ++it)
+		finder.addName(*it);
+	finder.setArea(m_geomX, m_geomX2, m_geomY, m_geomY2, m_yMin, m_yMax);
+	m_db->scanBlocks(finder);
+	finder.finish();
+	closeDatabase();
+
+	if (m_printStatistics) {
+		std::cerr << "Blocks searched: " << finder.blocksSearched() << std::endl;
+		std::cerr << "Blocks rejected: " << finder.blocksRejected() << std::endl;
+		std::cerr << "Nodes found: " << finder.nodesFound() << std::endl;
+	}
+}
+
 void TileGenerator::setDontWriteEmpty(bool f)
 {
 	m_dontWriteEmpty = f;
 }
 
+void TileGenerator::setIncremental(bool incremental)
+{
+	m_incremental = incremental;
+}
+
+void TileGenerator::setSurfaceCache(const std::string &fileName)
+{
+	m_surfaceCacheFile = fileName;
+}
+
+void TileGenerator::setTrustSurfaceCache(bool trust)
+{
+	m_trustSurfaceCache = trust;
+}
+
+void TileGenerator::setPrintStatistics(bool print)
+{
+	m_printStatistics = print;
+}
+
+void TileGenerator::setFullScan(bool fullScan)
+{
+	m_fullScan = fullScan;
+}
+
+void TileGenerator::setPngPreset(PngWriter::Preset preset)
+{
+	m_pngOptions.preset = preset;
+}
+
+void TileGenerator::setPalette(PngWriter::PaletteMode palette)
+{
+	m_pngOptions.palette = palette;
+}
+
+void TileGenerator::setUseGd(bool useGd)
+{
+	m_useGd = useGd;
+}
+
+void TileGenerator::setPyramid(const std::string &name)
+{
+	m_pyramidName = name;
+}
+
+void TileGenerator::setContainer(bool container)
+{
+	m_useContainer = container;
+}
+
+void TileGenerator::setTileLayout(const std::string &layout)
+{
+	m_tileLayout = layout;
+}
+
+void TileGenerator::setDedup(bool dedup)
+{
+	m_dedup = dedup;
+	m_writer.setDedup(dedup);
+}
+
 void TileGenerator::addMarker(std::string marker)
 {
 	m_markers.insert(marker);
 }
 
+void TileGenerator::setMarkerDir(const std::string &dir)
+{
+	m_markerDir = dir;
+}
+
 
 void TileGenerator::generate(const std::string &input, const std::string &output)
 {
@@ -266,6 +381,12 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 		return;
 	}
 
+	if (!m_surfaceCacheFile.empty())
+		m_surfaceCache.load(m_surfaceCacheFile, surfaceSettingsFingerprint());
+
+	if (m_pngOptions.palette == PngWriter::SHARED)
+		m_pngOptions.sharedPalette = sharedPalette();
+
 	createImage();
 
 
@@ -294,6 +415,12 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 			mf << "NumTiles: " << m_numTilesX << " " << m_numTilesY << std::endl;
 			mf << "MinTile: " << minTileX << " " << minTileY << std::endl;
 			mf << "TileSize: " << (m_tileW*16) << " " << (m_tileH*16) << std::endl;
+			if (m_useContainer)
+				mf << "Container: sqlite" << std::endl;
+			if (!m_tileLayout.empty())
+				mf << "Layout: " << m_tileLayout << std::endl;
+			if (!m_markerDir.empty())
+				mf << "Markers: " << m_markerDir << std::endl;
 			mf.close();
 		}
 		else
@@ -301,6 +428,57 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 			std::cerr << "Warning: could not write to '" << mfn.str() << "'!" << std::endl;
 		}
 
+		// Markers are only reported for rendered tiles, so render them all
+		bool skipUnchanged = m_incremental && m_markers.empty();
+		std::ostringstream manifestName;
+		manifestName << "manifest_" << output << ".txt";
+		uint64_t settings = settingsFingerprint();
+		FingerprintMap oldFingerprints, fingerprints;
+		if (skipUnchanged)
+			oldFingerprints = readManifest(manifestName.str(), settings);
+		PositionsList noPositions;
+
+		// Every tile there will be once the loop below is done. The list
+		// only is rewritten after that, a stale one would hide new tiles.
+		std::vector<std::pair<int, int> > tileList;
+		for (int x = 0; x < m_numTilesX; x++) {
+			for (int y = 0; y < m_numTilesY; y++) {
+				if (m_tiles.find(x + (y << 16)) != m_tiles.end() || !m_dontWriteEmpty)
+					tileList.push_back(std::make_pair(x + minTileX, y + minTileY));
+			}
+		}
+		remove(tileListName(output).c_str());
+
+		PyramidBuilder *pyramid = NULL;
+		int pyramidLevels = 0;
+		if (!m_pyramidName.empty()) {
+			if (m_tileW != m_tileH)
+				throw std::runtime_error("--pyramid needs square tiles");
+			pyramidLevels = pyramidMaxLevel(m_numTilesX, m_numTilesY, minTileX, minTileY);
+			pyramid = new PyramidBuilder(m_tileW * 16, pyramidLevels, tileList);
+		}
+
+		// The tiles are the bottom level of the pyramid in there and in a
+		// layout, so that buildpyramid can add the levels above
+		if (m_useContainer && !m_tileLayout.empty())
+			throw std::runtime_error("--container and --tilelayout don't go together");
+		if (m_useContainer || !m_tileLayout.empty() || !m_markerDir.empty())
+			m_tileLevel = pyramidMaxLevel(m_numTilesX, m_numTilesY, minTileX, minTileY);
+		if (m_useContainer) {
+			m_containerFile = output;
+			m_container = new TileContainer(output);
+			m_writer.setContainer(m_container);
+			std::ostringstream level, size;
+			level << m_tileLevel;
+			size << m_tileW * 16;
+			m_container->setMetadata("name", output);
+			m_container->setMetadata("format", "png");
+			m_container->setMetadata("minzoom", "0");
+			m_container->setMetadata("maxzoom", level.str());
+			m_container->setMetadata("tilesize", size.str());
+		}
+		PyramidBuilder::Finished pyramidTiles;
+
 		for (int x = 0; x < m_numTilesX; x++)
 		{
 			for (int y = 0; y < m_numTilesY; y++)
@@ -313,6 +491,52 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 
 				if (t != m_tiles.end() || !m_dontWriteEmpty)
 				{
+					std::pair<int, int> tile(x + minTileX, y + minTileY);
+					TileKey key = pyramidTileKey(m_tileLevel, tile.first, tile.second, 1);
+					ostringstream fn;
+					if (m_tileLayout.empty())
+						fn << (x + minTileX) << '_' << (y + minTileY) << '_' << output;
+					else
+						fn << layoutTileName(m_tileLayout, key);
+
+					FingerprintMap::const_iterator old = oldFingerprints.find(tile);
+					if (old != oldFingerprints.end() && tileExists(fn.str(), key)) {
+						uint64_t fingerprint = tileFingerprint(t != m_tiles.end() ? t->second : noPositions, settings);
+						if (m_drawPlayers)
+							fingerprint = hash_data(&fingerprint, sizeof(fingerprint), playersFingerprint(input_path));
+						fingerprints[tile] = fingerprint;
+						if (fingerprint == old->second) {
+							if (pyramid) {
+								Image *unchanged = loadTile(fn.str(), key);
+								pyramid->addTile(tile.first, tile.second, *unchanged, pyramidTiles);
+								delete unchanged;
+								writePyramidTiles(pyramidTiles);
+							}
+							continue;
+						}
+					}
+
+					// Tiles without blocks or anything drawn on them all look
+					// the same, so they share the first one written
+					bool plain = t == m_tiles.end() && !m_drawScale && !m_drawOrigin && !m_drawPlayers;
+					if (plain && m_dedup && !m_emptyTile.empty()) {
+						linkTile(m_emptyTile, m_emptyTileKey, fn.str(), key);
+						fingerprints[tile] = settings;
+						if (pyramid) {
+							m_image->fill(m_bgColor);
+							pyramid->addTile(tile.first, tile.second, *m_image, pyramidTiles);
+							writePyramidTiles(pyramidTiles);
+						}
+						continue;
+					}
+					if (plain && m_dedup) {
+						m_emptyTile = fn.str();
+						m_emptyTileKey = key;
+					}
+
+					m_fingerprint = settings;
+					// Shading must not depend on the previously rendered tile
+					m_blockPixelAttributes.setWidth(m_mapWidth);
 					m_image->fill(m_bgColor);
 					if (t != m_tiles.end())
 						renderMap(t->second);
@@ -324,18 +548,69 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 					}
 					if (m_drawPlayers) {
 						renderPlayers(input_path);
+						m_fingerprint = hash_data(&m_fingerprint, sizeof(m_fingerprint), playersFingerprint(input_path));
+					}
+					writeTile(fn.str(), key);
+					if (!m_markerDir.empty())
+						writeMarkerChunks();
+					fingerprints[tile] = m_fingerprint;
+					if (pyramid) {
+						pyramid->addTile(tile.first, tile.second, *m_image, pyramidTiles);
+						writePyramidTiles(pyramidTiles);
 					}
-					ostringstream fn;
-					fn << (x + minTileX) << '_' << (y + minTileY) << '_' << output;
-					writeImage(fn.str());
 				}
 			}
 		}
+		if (pyramid) {
+			pyramid->finish(pyramidTiles);
+			writePyramidTiles(pyramidTiles);
+			delete pyramid;
+			std::string tileUrl = defaultTileUrl(m_pyramidName);
+			if (m_container)
+				tileUrl = "tiles/{z}/{x}/{y}";
+			else if (!m_tileLayout.empty())
+				tileUrl = m_tileLayout;
+			outputLeafletCode(m_pyramidName, pyramidLevels, m_tileW * 16, tileUrl, m_markerDir);
+			writeTileIndex(m_pyramidName, pyramidLevels, tileList);
+		}
+
+		// A failed write throws here, before the manifest lists the tile as current
+		m_writer.flush();
+		if (m_container) {
+			m_writer.setContainer(NULL);
+			delete m_container;
+			m_container = NULL;
+		}
+		if (!m_markerDir.empty())
+			writeMarkerIndex(m_markerDir, m_tileLevel, m_markerIndex);
+		if (m_incremental)
+			writeManifest(manifestName.str(), settings, fingerprints);
+		writeTileList(tileListName(output), tileList);
 	}
 	else
 	{
 		m_image->fill(m_bgColor);
-		renderMap(m_positions);
+		// Only the highest node of each pixel counts then, so the order
+		// blocks are read in doesn't matter
+		bool scan = m_fullScan && !m_drawAlpha && m_markers.empty() &&
+			m_surfaceCacheFile.empty();
+		if (m_fullScan && !scan)
+			std::cerr << "Warning: --fullscan doesn't work with --drawalpha, --marker"
+				" or --surfacecache, rendering row by row" << std::endl;
+		if (!m_pyramidName.empty())
+			std::cerr << "Warning: --pyramid needs --tilesize, not building one" << std::endl;
+		if (m_useContainer)
+			std::cerr << "Warning: --container needs --tilesize, writing a plain image" << std::endl;
+		if (!m_tileLayout.empty())
+			std::cerr << "Warning: --tilelayout needs --tilesize, writing a plain image" << std::endl;
+		if (!m_markerDir.empty()) {
+			std::cerr << "Warning: --geojson needs --tilesize, printing markers instead" << std::endl;
+			m_markerDir.clear();
+		}
+		if (scan)
+			renderScan();
+		else
+			renderMap(m_positions);
 		if (m_drawScale) {
 			renderScale();
 		}
@@ -346,14 +621,30 @@ void TileGenerator::generate(const std::string &input, const std::string &output
 			renderPlayers(input_path);
 		}
 		writeImage(output);
+		m_writer.flush();
 	}
+	if (!m_surfaceCacheFile.empty())
+		m_surfaceCache.save(m_surfaceCacheFile, surfaceSettingsFingerprint());
 	closeDatabase();
 	printUnknown();
+	printStatistics();
 
 	delete m_image;
 	m_image = NULL;
 }
 
+void TileGenerator::exportDump(const std::string &input, const std::string &fileName)
+{
+	string input_path = input;
+	if (input_path[input.length() - 1] != PATH_SEPARATOR) {
+		input_path += PATH_SEPARATOR;
+	}
+
+	openDb(input_path);
+	DBDump::write(*m_db, fileName);
+	closeDatabase();
+}
+
 void TileGenerator::parseColorsStream(std::istream &in)
 {
 	char line[128];
@@ -397,6 +688,8 @@ void TileGenerator::openDb(const std::string &input)
 
 	if(backend == "sqlite3")
 		m_db = new DBSQLite3(input);
+	else if(backend == "dump")
+		m_db = new DBDump(input);
 #if USE_POSTGRESQL
 	else if(backend == "postgresql")
 		m_db = new DBPostgreSQL(input);
@@ -502,15 +795,45 @@ void TileGenerator::renderMap(PositionsList &positions)
 {
 
 	BlockDecoder blk(m_markers.size() > 0);
+	bool useCache = !m_surfaceCacheFile.empty();
+	// Markers are found while decoding, cached columns would hide them
+	bool readCache = useCache && m_markers.empty();
 	std::list<int> zlist = getZValueList(positions);
+	// Rows drawn from a trusted cache aren't read, so don't ask for them
+	std::set<int> trustedRows;
+	std::list<int> readRows;
+	for (std::list<int>::iterator zPosition = zlist.begin(); zPosition != zlist.end(); ++zPosition) {
+		if (readCache && m_trustSurfaceCache && !m_incremental && isRowCached(positions, *zPosition))
+			trustedRows.insert(*zPosition);
+		else
+			readRows.push_back(*zPosition);
+	}
+	m_db->prefetchBlocksOnZ(readRows);
 	for (std::list<int>::iterator zPosition = zlist.begin(); zPosition != zlist.end(); ++zPosition) {
 		int zPos = *zPosition;
 		std::map<int16_t, BlockList> blocks;
-		m_db->getBlocksOnZ(blocks, zPos);
+		bool trusted = trustedRows.count(zPos) > 0;
+		if (!trusted)
+			m_db->getBlocksOnZ(blocks, zPos);
 		for (PositionsList::const_iterator position = positions.begin(); position != positions.end(); ++position) {
 			if (position->second != zPos)
 				continue;
 
+			int xPos = position->first;
+			blocks[xPos].sort();
+			const BlockList &blockStack = blocks[xPos];
+			if (m_incremental)
+				hashBlockColumn(blockStack);
+			if (readCache && renderCachedColumn(blockStack, xPos, zPos, trusted))
+				continue;
+			if (trusted) {
+				// The entry couldn't be read after all, so the row is read
+				// from the map and the rest of it checked as if not trusted
+				m_db->getBlocksOnZ(blocks, zPos);
+				trusted = false;
+				blocks[xPos].sort();
+			}
+
 			m_readPixels.reset();
 			m_readInfo.reset();
 			for (int i = 0; i < 16; i++) {
@@ -518,33 +841,337 @@ void TileGenerator::renderMap(PositionsList &positions)
 					m_color[i][j] = m_bgColor; // This will be drawn by renderMapBlockBottom() for y-rows with only 'air', 'ignore' or unknown nodes if --drawalpha is used
 					m_color[i][j].a = 0; // ..but set alpha to 0 to tell renderMapBlock() not to use this color to mix a shade
 					m_thickness[i][j] = 0;
+					m_surface.pixels[i][j].flags = 0;
 				}
 			}
 
-			int xPos = position->first;
-			blocks[xPos].sort();
-			const BlockList &blockStack = blocks[xPos];
+			m_surface.numBlocks = 0;
 			for (BlockList::const_iterator it = blockStack.begin(); it != blockStack.end(); ++it) {
 				const BlockPos &pos = it->first;
+				m_surface.numBlocks++;
 
-				blk.reset();
-				blk.decode(it->second);
-				if (blk.isEmpty())
+				// Blocks outside of the Y range can't contribute, don't inflate them
+				if (pos.y * 16 + 15 < m_yMin || pos.y * 16 > m_yMax) {
+					m_blocksSkipped++;
 					continue;
-				renderMapBlock(blk, pos);
+				}
+				if (m_markers.empty()) {
+					renderDecodedBlock(decodeBlock(blk, pos, it->second), pos);
+				} else {
+					// Markers need the node names and metadata of the blocks
+					blk.reset();
+					blk.decode(it->second);
+					m_blocksDecoded++;
+					if (blk.isEmpty())
+						continue;
+					renderMapBlock(blk, pos);
+				}
 
 				// Exit out if all pixels for this MapBlock are covered
 				if (m_readPixels.full())
 					break;
 			}
+			m_surface.covered = m_readPixels.full();
 			if (!m_readPixels.full())
 				renderMapBlockBottom(blockStack.begin()->first);
+
+			if (useCache) {
+				m_surface.fingerprint = columnFingerprint(blockStack, m_surface.numBlocks);
+				m_surfaceCache.put(xPos, zPos, m_surface);
+			}
 		}
 		if (m_shading)
 			renderShading(zPos);
 	}
 }
 
+class TileGenerator::ScanVisitor : public DB::BlockVisitor {
+public:
+	ScanVisitor(TileGenerator &generator): generator(generator) {};
+	virtual void visit(const BlockPos &pos, const ustring &data) {
+		generator.scanBlock(blk, pos, data);
+	}
+private:
+	TileGenerator &generator;
+	BlockDecoder blk;
+};
+
+void TileGenerator::renderScan()
+{
+	ScanVisitor visitor(*this);
+	m_db->scanBlocks(visitor);
+
+	std::list<int> zlist = getZValueList(m_positions);
+	for (std::list<int>::iterator zPosition = zlist.begin(); zPosition != zlist.end(); ++zPosition) {
+		int zPos = *zPosition;
+		int zBegin = (m_zMax - zPos) * 16;
+		for (PositionsList::const_iterator position = m_positions.begin(); position != m_positions.end(); ++position) {
+			if (position->second != zPos)
+				continue;
+
+			int xPos = position->first;
+			int xBegin = (xPos - m_xMin) * 16;
+			ScanTiles::const_iterator tile = m_scanTiles.find(std::make_pair(
+				(xPos - m_xMin) / SCAN_TILE_SIZE, (zPos - m_zMin) / SCAN_TILE_SIZE));
+			if (tile == m_scanTiles.end())
+				continue;
+			const ScanPixel *pixels = &tile->second[0];
+			int tileX = (xPos - m_xMin) % SCAN_TILE_SIZE * 16;
+			int tileZ = (zPos - m_zMin) % SCAN_TILE_SIZE * 16;
+			for (int z = 0; z < 16; ++z) {
+				for (int x = 0; x < 16; ++x) {
+					const ScanPixel &px = pixels[(tileZ + z) * SCAN_TILE_SIZE * 16 + tileX + x];
+					if (px.color.a == 0)
+						continue;
+					setZoomed(xBegin + x, zBegin + 15 - z, px.color);
+					m_blockPixelAttributes.attribute(15 - z, xBegin + x).height = px.height;
+				}
+			}
+		}
+		if (m_shading)
+			renderShading(zPos);
+	}
+	m_scanTiles.clear();
+}
+
+void TileGenerator::scanBlock(BlockDecoder &blk, const BlockPos &pos, const ustring &data)
+{
+	if (pos.x < m_xMin || pos.x > m_xMax || pos.z < m_zMin || pos.z > m_zMax)
+		return;
+	if (pos.y * 16 + 15 < m_yMin || pos.y * 16 > m_yMax) {
+		m_blocksSkipped++;
+		return;
+	}
+
+	const DecodedBlock &decoded = decodeBlock(blk, pos, data);
+	if (decoded.nodes.empty())
+		return;
+	std::vector<ScanPixel> &tile = m_scanTiles[std::make_pair(
+		(pos.x - m_xMin) / SCAN_TILE_SIZE, (pos.z - m_zMin) / SCAN_TILE_SIZE)];
+	if (tile.empty())
+		tile.resize(SCAN_TILE_SIZE * 16 * SCAN_TILE_SIZE * 16);
+	int tileX = (pos.x - m_xMin) % SCAN_TILE_SIZE * 16;
+	int tileZ = (pos.z - m_zMin) % SCAN_TILE_SIZE * 16;
+	for (int z = 0; z < 16; ++z) {
+		for (int x = 0; x < 16; ++x) {
+			int i = decoded.begin[z * 16 + x];
+			if (i == decoded.begin[z * 16 + x + 1])
+				continue;
+			// without --drawalpha a column holds its topmost node only
+			const DecodedBlock::Node &node = decoded.nodes[i];
+			int height = pos.y * 16 + node.y;
+			ScanPixel &px = tile[(tileZ + z) * SCAN_TILE_SIZE * 16 + tileX + x];
+			if (px.color.a == 0 || height > px.height) {
+				px.height = height;
+				px.color = node.color.to_color().noAlpha();
+			}
+		}
+	}
+}
+
+bool TileGenerator::isRowCached(const PositionsList &positions, int zPos) const
+{
+	for (PositionsList::const_iterator position = positions.begin(); position != positions.end(); ++position) {
+		if (position->second == zPos && !m_surfaceCache.has(position->first, zPos))
+			return false;
+	}
+	return true;
+}
+
+uint64_t TileGenerator::columnFingerprint(const BlockList &blockStack, size_t numBlocks) const
+{
+	uint64_t hash = 0;
+	BlockList::const_iterator it = blockStack.begin();
+	for (size_t i = 0; i < numBlocks && it != blockStack.end(); ++i, ++it) {
+		int16_t p[3] = { it->first.x, it->first.y, it->first.z };
+		hash = hash_data(p, sizeof(p), hash);
+		hash = hash_data(it->second.data(), it->second.size(), hash);
+	}
+	return hash;
+}
+
+bool TileGenerator::renderCachedColumn(const BlockList &blockStack, int xPos, int zPos, bool trusted)
+{
+	if (!m_surfaceCache.get(xPos, zPos, m_surface))
+		return false;
+	if (!trusted) {
+		// The blocks read last time must be unchanged, and if they didn't
+		// cover the surface, no block may have been added below them.
+		if (blockStack.size() < m_surface.numBlocks ||
+				(!m_surface.covered && blockStack.size() != m_surface.numBlocks))
+			return false;
+		if (columnFingerprint(blockStack, m_surface.numBlocks) != m_surface.fingerprint)
+			return false;
+	}
+
+	int xBegin = (xPos - m_xMin) * 16;
+	int zBegin = (m_zMax - zPos) * 16;
+	for (int z = 0; z < 16; ++z) {
+		int imageY = zBegin + 15 - z;
+		for (int x = 0; x < 16; ++x) {
+			const SurfaceCache::Pixel &px = m_surface.pixels[z][x];
+			if (px.flags & SurfaceCache::PIXEL_DRAWN) {
+				setZoomed(xBegin + x, imageY, px.color);
+				m_blockPixelAttributes.attribute(15 - z, xBegin + x).thickness = px.thickness;
+			}
+			if (px.flags & SurfaceCache::PIXEL_HEIGHT)
+				m_blockPixelAttributes.attribute(15 - z, xBegin + x).height = px.height;
+		}
+	}
+	return true;
+}
+
+uint64_t TileGenerator::tileFingerprint(PositionsList &positions, uint64_t settings)
+{
+	m_fingerprint = settings;
+	std::list<int> zlist = getZValueList(positions);
+	m_db->prefetchBlocksOnZ(zlist);
+	for (std::list<int>::iterator zPosition = zlist.begin(); zPosition != zlist.end(); ++zPosition) {
+		int zPos = *zPosition;
+		std::map<int16_t, BlockList> blocks;
+		m_db->getBlocksOnZ(blocks, zPos);
+		for (PositionsList::const_iterator position = positions.begin(); position != positions.end(); ++position) {
+			if (position->second != zPos)
+				continue;
+			int xPos = position->first;
+			blocks[xPos].sort();
+			hashBlockColumn(blocks[xPos]);
+		}
+	}
+	return m_fingerprint;
+}
+
+void TileGenerator::hashBlockColumn(const BlockList &blockStack)
+{
+	for (BlockList::const_iterator it = blockStack.begin(); it != blockStack.end(); ++it) {
+		const BlockPos &pos = it->first;
+		// Only blocks that reach into the --min-y/--max-y range matter
+		if (pos.y * 16 + 15 < m_yMin || pos.y * 16 > m_yMax)
+			continue;
+		int16_t p[3] = { pos.x, pos.y, pos.z };
+		m_fingerprint = hash_data(p, sizeof(p), m_fingerprint);
+		m_fingerprint = hash_data(it->second.data(), it->second.size(), m_fingerprint);
+	}
+}
+
+uint64_t TileGenerator::settingsFingerprint() const
+{
+	std::ostringstream oss;
+	Color colors[4] = { m_bgColor, m_scaleColor, m_originColor, m_playerColor };
+	for (int i = 0; i < 4; ++i)
+		oss << (int) colors[i].r << ',' << (int) colors[i].g << ',' << (int) colors[i].b << ' ';
+	oss << m_drawOrigin << m_drawPlayers << m_drawScale << m_drawAlpha << m_shading << ' '
+		<< m_yMin << ' ' << m_yMax << ' ' << m_zoom << ' ' << m_scales << ' '
+		<< m_tileW << ' ' << m_tileH;
+	if (m_pngOptions.palette != PngWriter::EXACT)
+		oss << ' ' << m_pngOptions.palette;
+	std::string str = oss.str();
+	return hash_data(str.data(), str.size(), colorMapFingerprint());
+}
+
+uint64_t TileGenerator::surfaceSettingsFingerprint() const
+{
+	// Only what changes the columns found by renderMapBlock()
+	int settings[3] = { m_drawAlpha, m_yMin, m_yMax };
+	return hash_data(settings, sizeof(settings), colorMapFingerprint());
+}
+
+std::vector<int> TileGenerator::sharedPalette() const
+{
+	// Colors drawn as they are get entries of their own
+	std::vector<int> palette;
+	Color fixed[4] = { m_bgColor, m_scaleColor, m_originColor, m_playerColor };
+	bool drawn[4] = { true, m_drawScale, m_drawOrigin, m_drawPlayers };
+	for (int i = 0; i < 4; ++i) {
+		int color = (fixed[i].r << 16) | (fixed[i].g << 8) | fixed[i].b;
+		if (drawn[i] && std::find(palette.begin(), palette.end(), color) == palette.end())
+			palette.push_back(color);
+	}
+
+	// The rest is fit to the color map with every offset renderShading()
+	// can add: up to 36 brighter, or any darker. The small offsets of
+	// mostly flat ground weigh more.
+	std::map<int, unsigned long> candidates;
+	int minShade = m_shading ? -255 : 0, maxShade = m_shading ? 36 : 0;
+	for (ColorMap::const_iterator it = m_colorMap.begin(); it != m_colorMap.end(); ++it) {
+		const ColorEntry &c = it->second;
+		for (int d = minShade; d <= maxShade; ++d) {
+			int color = (colorSafeBounds(c.r + d) << 16) |
+				(colorSafeBounds(c.g + d) << 8) | colorSafeBounds(c.b + d);
+			candidates[color] += maxShade + 1 - mymin(abs(d), maxShade);
+		}
+	}
+	std::vector<int> reduced = PngWriter::reduceColors(
+		std::vector<std::pair<int, unsigned long> >(candidates.begin(), candidates.end()),
+		256 - palette.size());
+	palette.insert(palette.end(), reduced.begin(), reduced.end());
+	return palette;
+}
+
+uint64_t TileGenerator::colorMapFingerprint() const
+{
+	// The color map is unordered, so combine its entries independent of order
+	uint64_t hash = 0;
+	for (ColorMap::const_iterator it = m_colorMap.begin(); it != m_colorMap.end(); ++it) {
+		const ColorEntry &c = it->second;
+		uint8_t entry[5] = { c.r, c.g, c.b, c.a, c.t };
+		hash += hash_data(entry, sizeof(entry), hash_data(it->first.data(), it->first.size()));
+	}
+	return hash;
+}
+
+uint64_t TileGenerator::playersFingerprint(const std::string &inputPath) const
+{
+	// Same selection as renderPlayers()
+	uint64_t hash = 0;
+	PlayerAttributes players(inputPath);
+	for (PlayerAttributes::Players::iterator player = players.begin(); player != players.end(); ++player) {
+		if (player->x < m_xMin*16 || player->x > m_xMax * 16 ||
+			player->z < m_zMin*16 || player->z > m_zMax * 16 )
+			continue;
+		if (player->y < m_yMin || player->y > m_yMax)
+			continue;
+		int pos[2] = { getImageX(player->x, true), getImageY(player->z, true) };
+		hash = hash_data(pos, sizeof(pos), hash_data(player->name.data(), player->name.size(), hash));
+	}
+	return hash;
+}
+
+FingerprintMap TileGenerator::readManifest(const std::string &fileName, uint64_t settings) const
+{
+	FingerprintMap tiles;
+	std::ifstream mf(fileName.c_str());
+	std::string label;
+	uint64_t value;
+	mf >> label >> std::hex >> value;
+	// Different settings change every tile
+	if (!mf.good() || label != "Settings:" || value != settings)
+		return tiles;
+
+	while (mf >> label) {
+		int x, y;
+		mf >> std::dec >> x >> y >> std::hex >> value;
+		if (label != "Tile:" || mf.fail())
+			break;
+		tiles[std::pair<int, int>(x, y)] = value;
+	}
+	return tiles;
+}
+
+void TileGenerator::writeManifest(const std::string &fileName, uint64_t settings, const FingerprintMap &tiles) const
+{
+	std::ofstream mf(fileName.c_str());
+	if (!mf.is_open()) {
+		std::cerr << "Warning: could not write to '" << fileName << "'!" << std::endl;
+		return;
+	}
+
+	mf << "Settings: " << std::hex << settings << std::endl;
+	for (FingerprintMap::const_iterator it = tiles.begin(); it != tiles.end(); ++it)
+		mf << "Tile: " << std::dec << it->first.first << " " << it->first.second
+			<< " " << std::hex << it->second << std::endl;
+}
+
 void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 {
 	int xBegin = (pos.x - m_xMin) * 16;
@@ -564,14 +1191,7 @@ void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 					continue;
 
 				if (m_markers.count(name))
-				{
-					cout << "Marker: " << name << " " << (pos.x*16 + x) << " " << (pos.y * 16 + y) << " " << (pos.z * 16 + z) << endl;
-					BlockDecoder::NodeMetaData const & nm = blk.getNodeMetaData(x,y,z);
-					for (BlockDecoder::NodeMetaData::const_iterator i = nm.begin(); i != nm.end(); i++)
-					{
-						cout << "Marker: \"" << i->first << '"' << ":" <<   '"' << i->second << '"' << endl;
-					}
-				}
+					reportMarker(blk, pos, x, y, z, name);
 
 				ColorMap::const_iterator it = m_colorMap.find(name);
 				if (it == m_colorMap.end()) {
@@ -592,8 +1212,10 @@ void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 					// color became opaque, draw it
 					setZoomed(imageX, imageY, m_color[z][x]);
 					m_blockPixelAttributes.attribute(15 - z, xBegin + x).thickness = m_thickness[z][x];
+					recordSurface(x, z, m_color[z][x], m_thickness[z][x]);
 				} else {
 					setZoomed(imageX, imageY, c.noAlpha());
+					recordSurface(x, z, c.noAlpha(), 0);
 				}
 				m_readPixels.set(x, z);
 
@@ -601,6 +1223,8 @@ void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 				// inside transparent nodes (water) too
 				if (!m_readInfo.get(x, z)) {
 					m_blockPixelAttributes.attribute(15 - z, xBegin + x).height = pos.y * 16 + y;
+					m_surface.pixels[z][x].height = pos.y * 16 + y;
+					m_surface.pixels[z][x].flags |= SurfaceCache::PIXEL_HEIGHT;
 					m_readInfo.set(x, z);
 				}
 				break;
@@ -609,6 +1233,182 @@ void TileGenerator::renderMapBlock(const BlockDecoder &blk, const BlockPos &pos)
 	}
 }
 
+const DecodedBlock &TileGenerator::decodeBlock(BlockDecoder &blk, const BlockPos &pos, const ustring &data)
+{
+	int minY = (pos.y * 16 > m_yMin) ? 0 : m_yMin - pos.y * 16;
+	int maxY = (pos.y * 16 < m_yMax) ? 15 : m_yMax - pos.y * 16;
+	int window[2] = { minY, maxY };
+	uint64_t key = hash_data(window, sizeof(window), hash_data(data.data(), data.size()));
+
+	DecodeMemoIndex::iterator found = m_decodeMemoIndex.find(key);
+	if (found != m_decodeMemoIndex.end()) {
+		m_decodeMemo.splice(m_decodeMemo.begin(), m_decodeMemo, found->second);
+		const DecodedBlock &memo = found->second->second;
+		if (memo.minY == minY && memo.maxY == maxY && memo.data == data) {
+			m_blocksReused++;
+			return memo;
+		}
+		// Another block with the same hash, it takes the place of this one
+	} else if (m_decodeMemo.size() >= DECODE_MEMO_SIZE) {
+		m_decodeMemoIndex.erase(m_decodeMemo.back().first);
+		m_decodeMemo.splice(m_decodeMemo.begin(), m_decodeMemo, --m_decodeMemo.end());
+		m_decodeMemo.front().first = key;
+		m_decodeMemoIndex[key] = m_decodeMemo.begin();
+	} else {
+		m_decodeMemo.push_front(std::make_pair(key, DecodedBlock()));
+		m_decodeMemoIndex[key] = m_decodeMemo.begin();
+	}
+	DecodedBlock &decoded = m_decodeMemo.front().second;
+	decoded.nodes.clear();
+	decoded.data = data;
+	decoded.minY = minY;
+	decoded.maxY = maxY;
+
+	blk.reset();
+	blk.decode(data);
+	m_blocksDecoded++;
+
+	// Resolve the names of the block once instead of for every node
+	const BlockDecoder::NameMap &nameMap = blk.getNameMap();
+	std::vector<const std::string *> names;
+	std::vector<const ColorEntry *> colors;
+	for (BlockDecoder::NameMap::const_iterator it = nameMap.begin(); it != nameMap.end(); ++it) {
+		if (it->first >= (int) names.size()) {
+			names.resize(it->first + 1, NULL);
+			colors.resize(it->first + 1, NULL);
+		}
+		names[it->first] = &it->second;
+		ColorMap::const_iterator color = m_colorMap.find(it->second);
+		if (color != m_colorMap.end())
+			colors[it->first] = &color->second;
+	}
+
+	// Unlike renderMapBlock() this can't skip columns already covered by the
+	// blocks above, the result has to hold wherever the block shows up again
+	for (int z = 0; z < 16; ++z) {
+		for (int x = 0; x < 16; ++x) {
+			decoded.begin[z * 16 + x] = decoded.nodes.size();
+			if (names.empty())
+				continue;
+			for (int y = maxY; y >= minY; --y) {
+				int content = blk.getContentId(x, y, z);
+				if (content < 0)
+					continue;
+				if (content >= (int) names.size() || !names[content]) {
+					std::cerr << "Skipping node with invalid ID." << std::endl;
+					continue;
+				}
+				if (!colors[content]) {
+					m_unknownNodes.insert(*names[content]);
+					continue;
+				}
+				DecodedBlock::Node node;
+				node.y = y;
+				node.color = *colors[content];
+				decoded.nodes.push_back(node);
+				// without --drawalpha the first visible node is the only one drawn
+				if (!m_drawAlpha)
+					break;
+			}
+		}
+	}
+	decoded.begin[16 * 16] = decoded.nodes.size();
+	return decoded;
+}
+
+void TileGenerator::renderDecodedBlock(const DecodedBlock &decoded, const BlockPos &pos)
+{
+	int xBegin = (pos.x - m_xMin) * 16;
+	int zBegin = (m_zMax - pos.z) * 16;
+	for (int z = 0; z < 16; ++z) {
+		int imageY = zBegin + 15 - z;
+		for (int x = 0; x < 16; ++x) {
+			if (m_readPixels.get(x, z))
+				continue;
+			int imageX = xBegin + x;
+
+			int end = decoded.begin[z * 16 + x + 1];
+			for (int i = decoded.begin[z * 16 + x]; i < end; ++i) {
+				const DecodedBlock::Node &node = decoded.nodes[i];
+				const Color c = node.color.to_color();
+				if (m_drawAlpha) {
+					if (m_color[z][x].a == 0)
+						m_color[z][x] = c; // first visible time, no color mixing
+					else
+						m_color[z][x] = mixColors(m_color[z][x], c);
+					if(m_color[z][x].a < 0xff) {
+						// near thickness value to thickness of current node
+						m_thickness[z][x] = (m_thickness[z][x] + node.color.t) / 2.0;
+						continue;
+					}
+					// color became opaque, draw it
+					setZoomed(imageX, imageY, m_color[z][x]);
+					m_blockPixelAttributes.attribute(15 - z, xBegin + x).thickness = m_thickness[z][x];
+					recordSurface(x, z, m_color[z][x], m_thickness[z][x]);
+				} else {
+					setZoomed(imageX, imageY, c.noAlpha());
+					recordSurface(x, z, c.noAlpha(), 0);
+				}
+				m_readPixels.set(x, z);
+
+				// do this afterwards so we can record height values
+				// inside transparent nodes (water) too
+				if (!m_readInfo.get(x, z)) {
+					m_blockPixelAttributes.attribute(15 - z, xBegin + x).height = pos.y * 16 + node.y;
+					m_surface.pixels[z][x].height = pos.y * 16 + node.y;
+					m_surface.pixels[z][x].flags |= SurfaceCache::PIXEL_HEIGHT;
+					m_readInfo.set(x, z);
+				}
+				break;
+			}
+		}
+	}
+}
+
+void TileGenerator::reportMarker(const BlockDecoder &blk, const BlockPos &pos, int x, int y, int z, const std::string &name)
+{
+	int nodeX = pos.x * 16 + x, nodeY = pos.y * 16 + y, nodeZ = pos.z * 16 + z;
+	BlockDecoder::NodeMetaData const &nm = blk.getNodeMetaData(x, y, z);
+	if (m_markerDir.empty()) {
+		cout << "Marker: " << name << " " << nodeX << " " << nodeY << " " << nodeZ << endl;
+		for (BlockDecoder::NodeMetaData::const_iterator i = nm.begin(); i != nm.end(); i++)
+			cout << "Marker: \"" << i->first << '"' << ":" << '"' << i->second << '"' << endl;
+		return;
+	}
+
+	// Collected by the tile it is on, x and z as on the map, then y
+	std::ostringstream feature;
+	feature << "{\"type\": \"Feature\", \"geometry\": {\"type\": \"Point\", \"coordinates\": ["
+		<< nodeX << ", " << nodeZ << ", " << nodeY << "]}, \"properties\": {\"name\": " << json_string(name)
+		<< ", \"metadata\": {";
+	for (BlockDecoder::NodeMetaData::const_iterator i = nm.begin(); i != nm.end(); i++)
+		feature << (i == nm.begin() ? "" : ", ") << json_string(i->first) << ": " << json_string(i->second);
+	feature << "}}}";
+	int tileSizeX = m_tileW * 16, tileSizeY = m_tileH * 16;
+	int tileX = (nodeX >= 0 ? nodeX : nodeX - tileSizeX + 1) / tileSizeX;
+	int tileY = (nodeZ >= 0 ? nodeZ : nodeZ - tileSizeY + 1) / tileSizeY;
+	std::pair<int, std::string> &chunk = m_markerChunks[std::make_pair(tileX, tileY)];
+	chunk.second += (chunk.first ? ",\n" : "") + feature.str();
+	chunk.first++;
+}
+
+void TileGenerator::writeMarkerChunks()
+{
+	for (std::map<std::pair<int, int>, std::pair<int, std::string> >::const_iterator it = m_markerChunks.begin();
+			it != m_markerChunks.end(); ++it) {
+		TileKey key = pyramidTileKey(m_tileLevel, it->first.first, it->first.second, 1);
+		std::string fileName = markerChunkName(m_markerDir, key);
+		create_parent_dirs(fileName);
+		std::ofstream out(fileName.c_str());
+		out << "{\"type\": \"FeatureCollection\", \"features\": [\n" << it->second.second << "\n]}\n";
+		out.close();
+		if (out.fail())
+			std::cerr << "Warning: could not write to '" << fileName << "'!" << std::endl;
+		m_markerIndex[std::make_pair(key.x, key.y)] = it->second.first;
+	}
+	m_markerChunks.clear();
+}
+
 void TileGenerator::renderMapBlockBottom(const BlockPos &pos)
 {
 	if (!m_drawAlpha)
@@ -627,6 +1427,7 @@ void TileGenerator::renderMapBlockBottom(const BlockPos &pos)
 			setZoomed(imageX, imageY, m_color[z][x]);
 			m_readPixels.set(x, z);
 			m_blockPixelAttributes.attribute(15 - z, xBegin + x).thickness = m_thickness[z][x];
+			recordSurface(x, z, m_color[z][x], m_thickness[z][x]);
 		}
 	}
 }
@@ -776,8 +1577,87 @@ inline std::list<int> TileGenerator::getZValueList(PositionsList &positions) con
 
 void TileGenerator::writeImage(const std::string &output)
 {
-	m_image->save(output);
-	cout << "wrote image:" << output << endl;
+	// Printed in the order the images were rendered, m_writer saves them
+	// in the background and reports failures on flush()
+	m_writer.write(m_image->clone(), output, m_pngOptions, m_useGd);
+	cout << "wrote image:" << output << '\n';
+}
+
+static std::string containerTileName(const std::string &container, const TileKey &key)
+{
+	std::ostringstream name;
+	name << container << ':' << key.level << '/' << key.x << '/' << key.y;
+	return name.str();
+}
+
+void TileGenerator::writeTile(const std::string &fileName, const TileKey &key)
+{
+	if (!m_container) {
+		writeImage(fileName);
+		return;
+	}
+	m_writer.write(m_image->clone(), key, m_pngOptions, m_useGd);
+	cout << "wrote image:" << containerTileName(m_containerFile, key) << '\n';
+}
+
+void TileGenerator::linkTile(const std::string &target, const TileKey &targetKey,
+	const std::string &fileName, const TileKey &key)
+{
+	if (m_container) {
+		m_writer.link(targetKey, key);
+		cout << "wrote image:" << containerTileName(m_containerFile, key) << '\n';
+	} else {
+		m_writer.link(target, fileName);
+		cout << "wrote image:" << fileName << '\n';
+	}
+}
+
+bool TileGenerator::tileExists(const std::string &fileName, const TileKey &key)
+{
+	if (m_container)
+		return m_container->contains(key);
+	return ifstream(fileName.c_str()).good();
+}
+
+Image *TileGenerator::loadTile(const std::string &fileName, const TileKey &key)
+{
+	if (!m_container)
+		return new Image(fileName);
+	std::string png;
+	if (!m_container->get(key, png))
+		throw std::runtime_error("Tile missing from the container: " + containerTileName(m_containerFile, key));
+	return Image::fromPng(png);
+}
+
+void TileGenerator::writePyramidTiles(PyramidBuilder::Finished &tiles)
+{
+	for (size_t i = 0; i < tiles.size(); ++i) {
+		const TileKey &key = tiles[i].first;
+		if ((m_container || !m_tileLayout.empty()) && key.level == m_tileLevel) {
+			// The tile itself is there already
+			delete tiles[i].second;
+		} else if (m_container) {
+			m_writer.write(tiles[i].second, key, m_pngOptions, m_useGd);
+			cout << "wrote image:" << containerTileName(m_containerFile, key) << '\n';
+		} else {
+			std::string name = m_tileLayout.empty() ? pyramidTileName(m_pyramidName, key) :
+				layoutTileName(m_tileLayout, key);
+			m_writer.write(tiles[i].second, name, m_pngOptions, m_useGd);
+			cout << "wrote image:" << name << '\n';
+		}
+	}
+	tiles.clear();
+}
+
+void TileGenerator::printStatistics()
+{
+	if (!m_printStatistics)
+		return;
+	std::cerr << "Blocks decoded: " << m_blocksDecoded << std::endl;
+	std::cerr << "Blocks reused: " << m_blocksReused << std::endl;
+	std::cerr << "Blocks skipped: " << m_blocksSkipped << std::endl;
+	if (m_dedup)
+		std::cerr << "Images linked: " << m_writer.linkedCount() << std::endl;
 }
 
 void TileGenerator::printUnknown()
@@ -808,6 +1688,14 @@ inline void TileGenerator::setZoomed(int x, int y, Color color)
 	m_image->drawFilledRect(getImageX(x), getImageY(y), m_zoom, m_zoom, color);
 }
 
+inline void TileGenerator::recordSurface(int x, int z, Color color, uint8_t thickness)
+{
+	SurfaceCache::Pixel &px = m_surface.pixels[z][x];
+	px.color = color;
+	px.thickness = thickness;
+	px.flags |= SurfaceCache::PIXEL_DRAWN;
+}
+
 
 void TileGenerator::sortPositionsIntoTiles()
 {
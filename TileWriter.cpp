@@ -0,0 +1,295 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "TileWriter.h"
+#include "util.h"
+
+// Threads writing images, and the number of images waiting for them
+#define TILEWRITER_THREADS 4
+#define TILEWRITER_QUEUE 8
+// Images kept to compare repeats with
+#define TILEWRITER_KEPT 16
+
+TileWriter::TileWriter():
+	m_dedup(false),
+	m_container(NULL),
+	m_linkedCount(0)
+#if __cplusplus >= 201103L
+	, m_busy(0), m_stop(false)
+#endif
+{
+}
+
+TileWriter::~TileWriter()
+{
+#if __cplusplus >= 201103L
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_queued.notify_all();
+	for (size_t i = 0; i < m_threads.size(); ++i)
+		m_threads[i].join();
+	for (size_t i = 0; i < m_jobs.size(); ++i)
+		delete m_jobs[i].image;
+#endif
+	for (size_t i = 0; i < m_kept.size(); ++i)
+		delete m_kept[i].second;
+}
+
+static std::string temporaryName(const std::string &fileName)
+{
+	// Keep the extension, gd picks the format by it
+	std::string::size_type slash = fileName.find_last_of("/\\");
+	std::string::size_type base = slash == std::string::npos ? 0 : slash + 1;
+	return fileName.substr(0, base) + ".tmp." + fileName.substr(base);
+}
+
+void TileWriter::setDedup(bool dedup)
+{
+	m_dedup = dedup;
+}
+
+void TileWriter::setContainer(TileContainer *container)
+{
+	m_container = container;
+}
+
+void TileWriter::save(const Job &job)
+{
+	if (job.target.fileName.empty()) {
+		m_container->put(job.target.key, job.image->png(job.options, job.useGd));
+		return;
+	}
+	const std::string &fileName = job.target.fileName;
+	std::string tempName = temporaryName(fileName);
+	create_parent_dirs(fileName);
+	job.image->save(tempName, job.options, job.useGd);
+	if (rename(tempName.c_str(), fileName.c_str()) != 0) {
+		std::string error = "Error saving image " + fileName + ": " + strerror(errno);
+		remove(tempName.c_str());
+		throw std::runtime_error(error);
+	}
+}
+
+void TileWriter::write(Image *image, const std::string &fileName,
+	const PngWriter::Options &options, bool useGd)
+{
+	Job job;
+	job.image = image;
+	job.target.fileName = fileName;
+	job.options = options;
+	job.useGd = useGd;
+	queue(job);
+}
+
+void TileWriter::write(Image *image, const TileKey &key,
+	const PngWriter::Options &options, bool useGd)
+{
+	Job job;
+	job.image = image;
+	job.target.key = key;
+	job.options = options;
+	job.useGd = useGd;
+	queue(job);
+}
+
+void TileWriter::queue(const Job &job)
+{
+	Image *image = job.image;
+	if (m_dedup) {
+		const int *const *rows = image->pixels();
+		Hash hash(0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL);
+		size_t rowSize = image->GetWidth() * sizeof(int);
+		for (int y = 0; y < image->GetHeight(); ++y) {
+			hash.first = hash_data(rows[y], rowSize, hash.first);
+			hash.second = hash_data(rows[y], rowSize, hash.second);
+		}
+		WrittenMap::const_iterator written = m_written.find(hash);
+		if (written != m_written.end() && isRepeat(*image, hash, written->second)) {
+			delete image;
+			m_links.push_back(std::make_pair(written->second, job.target));
+			return;
+		}
+		// A different image with the same hashes is written on its own
+		if (written == m_written.end()) {
+			m_written.insert(std::make_pair(hash, job.target));
+			if (m_kept.size() >= TILEWRITER_KEPT) {
+				delete m_kept.back().second;
+				m_kept.pop_back();
+			}
+			m_kept.push_front(std::make_pair(hash, image->clone()));
+		}
+	}
+
+#if __cplusplus >= 201103L
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_threads.empty()) {
+		for (int i = 0; i < TILEWRITER_THREADS; ++i)
+			m_threads.push_back(std::thread(&TileWriter::run, this));
+	}
+	m_done.wait(lock, [this]() { return m_jobs.size() < TILEWRITER_QUEUE; });
+	m_jobs.push_back(job);
+	lock.unlock();
+	m_queued.notify_one();
+#else
+	try {
+		save(job);
+	} catch (...) {
+		delete image;
+		throw;
+	}
+	delete image;
+#endif
+}
+
+bool TileWriter::isRepeat(const Image &image, const Hash &hash, const Target &target)
+{
+	for (size_t i = 0; i < m_kept.size(); ++i) {
+		if (m_kept[i].first != hash)
+			continue;
+		std::pair<Hash, Image *> kept = m_kept[i];
+		m_kept.erase(m_kept.begin() + i);
+		m_kept.push_front(kept);
+		return kept.second->samePixels(image);
+	}
+
+	// Compare with what was saved, where a lossy format or palette
+	// makes even a repeat differ it is written on its own
+	waitForJobs();
+	Image *saved = NULL;
+	bool same = false;
+	try {
+		std::string png;
+		if (!target.fileName.empty())
+			saved = new Image(target.fileName);
+		else if (m_container->get(target.key, png))
+			saved = Image::fromPng(png);
+		same = saved && image.samePixels(*saved);
+	} catch (std::exception &e) {
+		same = false;
+	}
+	delete saved;
+	return same;
+}
+
+void TileWriter::waitForJobs()
+{
+#if __cplusplus >= 201103L
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this]() { return m_jobs.empty() && m_busy == 0; });
+#endif
+}
+
+void TileWriter::link(const std::string &target, const std::string &fileName)
+{
+	Target from, to;
+	from.fileName = target;
+	to.fileName = fileName;
+	m_links.push_back(std::make_pair(from, to));
+}
+
+void TileWriter::link(const TileKey &target, const TileKey &key)
+{
+	Target from, to;
+	from.key = target;
+	to.key = key;
+	m_links.push_back(std::make_pair(from, to));
+}
+
+void TileWriter::flush()
+{
+#if __cplusplus >= 201103L
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_done.wait(lock, [this]() { return m_jobs.empty() && m_busy == 0; });
+	if (!m_error.empty()) {
+		std::string error = m_error;
+		m_error.clear();
+		m_links.clear();
+		throw std::runtime_error(error);
+	}
+	lock.unlock();
+#endif
+	// The targets are complete now
+	writeLinks();
+}
+
+void TileWriter::writeLinks()
+{
+	std::vector<std::pair<Target, Target> > links;
+	links.swap(m_links);
+	for (size_t i = 0; i < links.size(); ++i) {
+		if (links[i].first.fileName.empty())
+			m_container->link(links[i].first.key, links[i].second.key);
+		else
+			linkFile(links[i].first.fileName, links[i].second.fileName);
+		m_linkedCount++;
+	}
+}
+
+void TileWriter::linkFile(const std::string &target, const std::string &fileName)
+{
+	std::string tempName = temporaryName(fileName);
+	create_parent_dirs(fileName);
+	remove(tempName.c_str());
+#ifndef _WIN32
+	bool linked = ::link(target.c_str(), tempName.c_str()) == 0;
+#else
+	bool linked = false;
+#endif
+	if (!linked) {
+		std::ifstream in(target.c_str(), std::ios::binary);
+		std::ofstream out(tempName.c_str(), std::ios::binary | std::ios::trunc);
+		if (in.is_open() && out.is_open())
+			out << in.rdbuf();
+		out.close();
+		if (!in.is_open() || out.fail()) {
+			remove(tempName.c_str());
+			throw std::runtime_error("Error copying image " + target + " to " + fileName);
+		}
+	}
+	if (rename(tempName.c_str(), fileName.c_str()) != 0) {
+		std::string error = "Error saving image " + fileName + ": " + strerror(errno);
+		remove(tempName.c_str());
+		throw std::runtime_error(error);
+	}
+	// rename() leaves both names alone if they already were the same file
+	remove(tempName.c_str());
+}
+
+#if __cplusplus >= 201103L
+void TileWriter::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (true) {
+		m_queued.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+		if (m_stop)
+			return;
+		Job job = m_jobs.front();
+		m_jobs.pop_front();
+		m_busy++;
+		lock.unlock();
+		m_done.notify_all();
+
+		std::string error;
+		try {
+			save(job);
+		} catch (std::exception &e) {
+			error = e.what();
+		}
+		delete job.image;
+
+		lock.lock();
+		m_busy--;
+		if (!error.empty() && m_error.empty())
+			m_error = error;
+		m_done.notify_all();
+	}
+}
+#endif
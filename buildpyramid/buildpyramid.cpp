@@ -1,26 +1,202 @@
 #include <math.h>
 #include <assert.h>
+#include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <set>
 #include <sstream>
+#include <stdexcept>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <atomic>
+#include <mutex>
+#include <thread>
+#endif
 #include "../include/Image.h"
+#include "../include/Pyramid.h"
+#include "../include/TileContainer.h"
+#include "../include/util.h"
+
+// Pyramid tile by level and the minimum tile covered
+typedef std::pair<int, std::pair<int, int> > NodeKey;
+
+// What is known about pyramid tiles before building them: the number of
+// tiles below the ones saved already, or REBUILD. With exhaustive set,
+// pyramid tiles that aren't listed have no tiles below them.
+#define REBUILD -1
+struct Known
+{
+	Known(): exhaustive(false) {}
+	std::map<NodeKey, int> tiles;
+	bool exhaustive;
+};
+
+// Modification time and size of the tiles found, to see which changed
+typedef std::map<std::pair<int, int>, std::pair<int64_t, int64_t> > LeafMap;
+
+#define STATE_VERSION 1
+
+struct Subtree
+{
+	int minTileX, minTileY, maxTileX, maxTileY;
+	int count;
+};
+
+#if __cplusplus >= 201103L
+static std::mutex outputMutex;
+#endif
+
+// Where the tiles are when minetestmapper wrote them with --container, or
+// the file names with --tilelayout. The tiles are the bottom level of the
+// pyramid then, the levels above go in there too.
+static TileContainer *container = NULL;
+static std::string layout;
+static int bottomLevel = 0;
+
+static Image *loadTile(const TileKey &key)
+{
+	std::string png;
+	if (!container->get(key, png))
+		throw std::runtime_error("Tile missing from the container");
+	return Image::fromPng(png);
+}
+
+static std::string leafFileName(std::string const &baseName, int tileX, int tileY)
+{
+	if (!layout.empty())
+		return layoutTileName(layout, pyramidTileKey(bottomLevel, tileX, tileY, 1));
+	std::ostringstream inf;
+	inf << tileX << "_" << tileY << "_" << baseName;
+	return inf.str();
+}
 
-void outputLeafletCode(std::string const &output, int maxLevel, int tileSize);
+static std::string pyramidFileName(std::string const &out, int level, int minTileX, int minTileY, int divisor, bool leafletMode)
+{
+	if (!layout.empty())
+		return layoutTileName(layout, pyramidTileKey(level, minTileX, minTileY, divisor));
+	return pyramidTileName(out, level, minTileX, minTileY, divisor, leafletMode);
+}
+
+static NodeKey nodeKey(int level, int tileX, int tileY, int maxDim)
+{
+	int size = maxDim >> level;
+	tileX = (tileX >= 0 ? tileX : tileX - size + 1) / size * size;
+	tileY = (tileY >= 0 ? tileY : tileY - size + 1) / size * size;
+	return std::make_pair(level, std::make_pair(tileX, tileY));
+}
+
+static LeafMap scanLeaves(std::string const &baseName, int minTileX, int minTileY, int numTilesX, int numTilesY)
+{
+	if (container)
+	{
+		// Every tile on the bottom level is one, its image id tells
+		// whether it changed
+		LeafMap leaves;
+		std::vector<std::pair<std::pair<int, int>, int64_t> > tiles = container->tiles(bottomLevel);
+		for (size_t i = 0; i < tiles.size(); i++)
+			leaves[std::make_pair(tiles[i].first.first, -tiles[i].first.second - 1)] = std::make_pair(tiles[i].second, (int64_t) 0);
+		return leaves;
+	}
+
+	// The tiles minetestmapper listed, or else every position of the grid,
+	// it writes nothing outside of that
+	std::vector<std::pair<int, int> > candidates;
+	if (!readTileList(tileListName(baseName), candidates))
+	{
+		for (int x = minTileX; x < minTileX + numTilesX; x++)
+		{
+			for (int y = minTileY; y < minTileY + numTilesY; y++)
+				candidates.push_back(std::make_pair(x, y));
+		}
+	}
+
+	LeafMap leaves;
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		struct stat st;
+		if (stat(leafFileName(baseName, candidates[i].first, candidates[i].second).c_str(), &st) == 0)
+			leaves[candidates[i]] = std::make_pair((int64_t) st.st_mtime, (int64_t) st.st_size);
+	}
+	return leaves;
+}
+
+static bool readState(std::string const &fileName, int maxLevel, int tileSize, std::string const &baseName, LeafMap &leaves)
+{
+	std::ifstream in(fileName.c_str());
+	std::string label, name;
+	int version, level, size;
+	if (!(in >> label >> version >> level >> size >> name) || label != "PyramidState:" ||
+			version != STATE_VERSION || level != maxLevel || size != tileSize || name != baseName)
+		return false;
+	int x, y;
+	int64_t mtime, fileSize;
+	while (in >> x >> y >> mtime >> fileSize)
+		leaves[std::make_pair(x, y)] = std::make_pair(mtime, fileSize);
+	return in.eof();
+}
+
+static void writeState(std::string const &fileName, int maxLevel, int tileSize, std::string const &baseName, const LeafMap &leaves)
+{
+	std::ofstream out(fileName.c_str());
+	out << "PyramidState: " << STATE_VERSION << " " << maxLevel << " " << tileSize << " " << baseName << std::endl;
+	for (LeafMap::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+		out << it->first.first << " " << it->first.second << " " << it->second.first << " " << it->second.second << "\n";
+	if (!out)
+		std::cerr << "Warning: could not write to '" << fileName << "'!" << std::endl;
+}
 
-int buildPyramid(std::string const &baseName, std::string const &out, Image *im, int minTileX,int minTileY, int maxTileX, int maxTileY, int level, int divisor, bool leafletMode)
+int buildPyramid(std::string const &baseName, std::string const &out, Image *im, int minTileX,int minTileY, int maxTileX, int maxTileY, int level, int divisor, bool leafletMode,
+	const Known *known = NULL)
 {
 	int count = 0;
 
 	Color empty(0,0,0,0);
 	im->fill(empty, true);
+	if (known)
+	{
+		std::map<NodeKey, int>::const_iterator k = known->tiles.find(std::make_pair(level, std::make_pair(minTileX, minTileY)));
+		if (k == known->tiles.end() && known->exhaustive)
+			return 0;
+		if (k != known->tiles.end() && k->second != REBUILD)
+		{
+			// Its image was saved already, read it back instead of its children
+			if (k->second && container)
+			{
+				Image *in = loadTile(pyramidTileKey(level, minTileX, minTileY, divisor));
+				in->blit(im, 0, 0);
+				delete in;
+			}
+			else if (k->second)
+			{
+				Image in(pyramidFileName(out, level, minTileX, minTileY, divisor, leafletMode));
+				in.blit(im, 0, 0);
+			}
+			return k->second;
+		}
+	}
+
 	if ((maxTileX - minTileX) == 1)
 	{
 		assert((maxTileY - minTileY) == 1);
-		std::ostringstream inf;
-		inf << minTileX << "_" << minTileY << "_" << baseName;
+		if (container)
+		{
+			// Tiles that are gone are rebuilt too
+			std::string png;
+			if (!container->get(pyramidTileKey(level, minTileX, minTileY, divisor), png))
+				return 0;
+			Image *in = Image::fromPng(png);
+			in->blit(im, 0, 0);
+			delete in;
+			return 1;
+		}
 		try
 		{
-			Image in(inf.str());
+			Image in(leafFileName(baseName, minTileX, minTileY));
 
 			if (in.GetWidth())
 			{
@@ -33,6 +209,8 @@ int buildPyramid(std::string const &baseName, std::string const &out, Image *im,
 			// image is allowed not to exist, just return 0;
 			return 0;
 		}
+		if (!layout.empty())
+			return count;
 
 	}
 	else
@@ -41,59 +219,111 @@ int buildPyramid(std::string const &baseName, std::string const &out, Image *im,
 
 		int halfX = minTileX + (maxTileX - minTileX)/2;
 		int halfY = minTileY + (maxTileY - minTileY)/2;
-		int c = buildPyramid(baseName, out, &subTile, minTileX, minTileY, halfX, halfY, level +1, divisor / 2, leafletMode);
+		int c = buildPyramid(baseName, out, &subTile, minTileX, minTileY, halfX, halfY, level +1, divisor / 2, leafletMode, known);
 		if (c)
 		{
-			subTile.scaleBlit(im, 0, im->GetHeight()/2, im->GetWidth()/2, im->GetHeight() / 2);
+			subTile.downsample(im, 0, im->GetHeight()/2);
 			count+=c;
 		}
 
-		c = buildPyramid(baseName, out, &subTile, halfX,  minTileY, maxTileX, halfY, level +1, divisor / 2, leafletMode);
+		c = buildPyramid(baseName, out, &subTile, halfX,  minTileY, maxTileX, halfY, level +1, divisor / 2, leafletMode, known);
 		if (c)
 		{
-			subTile.scaleBlit(im, im->GetWidth()/2, im->GetHeight()/2, im->GetWidth()/2, im->GetHeight() / 2);
+			subTile.downsample(im, im->GetWidth()/2, im->GetHeight()/2);
 			count+=c;
 		}
 
-		c = buildPyramid(baseName, out, &subTile, minTileX, halfY, halfX, maxTileY, level +1, divisor / 2, leafletMode);
+		c = buildPyramid(baseName, out, &subTile, minTileX, halfY, halfX, maxTileY, level +1, divisor / 2, leafletMode, known);
 		if (c)
 		{
-			subTile.scaleBlit(im, 0, 0, im->GetWidth()/2, im->GetHeight() / 2);
+			subTile.downsample(im, 0, 0);
 			count+=c;
 		}
 
 
-		c= buildPyramid(baseName, out, &subTile, halfX,  halfY, maxTileX, maxTileY, level +1, divisor / 2, leafletMode);
+		c= buildPyramid(baseName, out, &subTile, halfX,  halfY, maxTileX, maxTileY, level +1, divisor / 2, leafletMode, known);
 		if (c)
 		{
-			subTile.scaleBlit(im, im->GetWidth()/2, 0, im->GetWidth()/2, im->GetHeight() / 2);
+			subTile.downsample(im, im->GetWidth()/2, 0);
 			count+=c;
 		}
 
 
 	}
 
-	if (count)
+	if (count && container)
 	{
-		std::ostringstream of;
-
-		of << level << "_" <<  (minTileX / divisor) << "_" << ((leafletMode ? -1 : 1) * minTileY/divisor - (leafletMode ? 1 : 0)) << "_" << out;
-
-		std::cout << "Writing image: " << of.str() << std::endl;
-		im->save(of.str());
+		TileKey key = pyramidTileKey(level, minTileX, minTileY, divisor);
+		{
+#if __cplusplus >= 201103L
+			std::lock_guard<std::mutex> lock(outputMutex);
+#endif
+			std::cout << "Writing image: " << key.level << "/" << key.x << "/" << key.y << std::endl;
+		}
+		container->put(key, im->png());
+	}
+	else if (count)
+	{
+		std::string of = pyramidFileName(out, level, minTileX, minTileY, divisor, leafletMode);
+		{
+#if __cplusplus >= 201103L
+			std::lock_guard<std::mutex> lock(outputMutex);
+#endif
+			std::cout << "Writing image: " << of << std::endl;
+		}
+		if (!layout.empty())
+			create_parent_dirs(of);
+		im->save(of);
 
 	}
 	return count;
 }
 
+// Builds the subtrees on all cores, every thread with its own image
+static void buildSubtrees(std::string const &baseName, std::string const &out, int tileSize, std::vector<Subtree> &subtrees, int level, int divisor,
+	const Known &known)
+{
+#if __cplusplus >= 201103L
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		Image im(tileSize, tileSize);
+		for (size_t i = next++; i < subtrees.size(); i = next++)
+		{
+			Subtree &s = subtrees[i];
+			s.count = buildPyramid(baseName, out, &im, s.minTileX, s.minTileY, s.maxTileX, s.maxTileY, level, divisor, true, &known);
+		}
+	};
+	size_t numThreads = std::max(1U, std::thread::hardware_concurrency());
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < numThreads; ++i)
+		threads.push_back(std::thread(worker));
+	worker();
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+#else
+	Image im(tileSize, tileSize);
+	for (size_t i = 0; i < subtrees.size(); ++i)
+	{
+		Subtree &s = subtrees[i];
+		s.count = buildPyramid(baseName, out, &im, s.minTileX, s.minTileY, s.maxTileX, s.maxTileY, level, divisor, true, &known);
+	}
+#endif
+}
+
 
 int main(int argc, char **argv)
 {
-	if (argc !=3)
+	bool incremental = argc == 4 && std::string(argv[1]) == "--incremental";
+	if (argc != 3 && !incremental)
 	{
-		std::cerr << "Usage: buildpyramid <metadatafile> <outname>\n" << std::endl;
+		std::cerr << "Usage: buildpyramid [--incremental] <metadatafile> <outname>\n" << std::endl;
 		exit(1);
 	}
+	if (incremental)
+	{
+		argv++;
+		argc--;
+	}
 
 	std::ifstream mt;
 	mt.open(argv[1], std::ios::in);
@@ -105,22 +335,12 @@ int main(int argc, char **argv)
 	}
 
 
-	std::string baseName;
+	std::string baseName, containerType, markerDir;
 	int numTilesX, numTilesY, minTileX, minTileY, tileSizeX, tileSizeY;
 	int count=0;
-	while (true)
+	std::string label;
+	while (mt >> label)
 	{
-
-		std::string label;
-
-		mt >> label;
-
-		if (mt.eof())
-		{
-			std::cerr << "Error parsing metadata file\n" << std::endl;
-			exit(1);
-		}
-
 		if (label == "BaseName:")
 		{
 			mt >> baseName;
@@ -141,11 +361,24 @@ int main(int argc, char **argv)
 			mt >> tileSizeX >> tileSizeY;
 			count++;
 		}
-
-		if (count >3)
+		else if (label == "Container:")
+		{
+			mt >> containerType;
+		}
+		else if (label == "Layout:")
 		{
-			break;
+			mt >> layout;
 		}
+		else if (label == "Markers:")
+		{
+			mt >> markerDir;
+		}
+	}
+
+	if (count < 4)
+	{
+		std::cerr << "Error parsing metadata file\n" << std::endl;
+		exit(1);
 	}
 
 	if (tileSizeX != tileSizeY)
@@ -154,113 +387,147 @@ int main(int argc, char **argv)
 		exit(1);
 	}
 
-	int maxDim = numTilesX + minTileX;
-
-	maxDim = -minTileX > maxDim ? -minTileX : maxDim;
-
-	maxDim = numTilesY + minTileY > maxDim ? numTilesY - minTileY : maxDim;
-
-	maxDim = -minTileY > maxDim ? -minTileY : maxDim;
+	int maxLevel = pyramidMaxLevel(numTilesX, numTilesY, minTileX, minTileY);
+	int maxDim = 1 << maxLevel;
 
-	assert(maxDim >0);
+	Image im(tileSizeX, tileSizeY);
+	std::string out(argv[2]);
 
-	int maxLevel;
-	// round up to power of 2
-	for (int i = 0; i < 62 ; i++)
+	if (containerType == "sqlite")
 	{
-		if ((1 << i) >= maxDim)
+		try
 		{
-			maxDim = 1<<i;
-			maxLevel = i;
-			break;
+			container = new TileContainer(baseName);
 		}
+		catch (std::runtime_error const &e)
+		{
+			std::cerr << e.what() << std::endl;
+			exit(1);
+		}
+		bottomLevel = maxLevel;
+	}
+	else if (!containerType.empty())
+	{
+		std::cerr << "Unknown tile container '" << containerType << "'" << std::endl;
+		exit(1);
+	}
+	else if (!layout.empty())
+	{
+		bottomLevel = maxLevel;
 	}
 
+	// Only the pyramid tiles above tiles that changed since the last run
+	// are built again, the others are read back where needed. Pyramid
+	// tiles without any tiles below aren't looked at.
+	LeafMap leaves = scanLeaves(baseName, minTileX, minTileY, numTilesX, numTilesY);
+	std::string stateName = "pyramid_" + out + ".txt";
+	LeafMap previous;
+	Known known;
+	std::set<NodeKey> removed;
+	if (incremental && readState(stateName, maxLevel, tileSizeX, baseName, previous))
+	{
+		known.exhaustive = true;
+		for (LeafMap::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+		{
+			for (int level = maxLevel; level >= 0; level--)
+				known.tiles[nodeKey(level, it->first.first, it->first.second, maxDim)]++;
+		}
+		std::set<std::pair<int, int> > changed;
+		for (LeafMap::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+		{
+			LeafMap::const_iterator p = previous.find(it->first);
+			if (p == previous.end() || p->second != it->second)
+				changed.insert(it->first);
+		}
+		for (LeafMap::const_iterator it = previous.begin(); it != previous.end(); ++it)
+		{
+			if (leaves.find(it->first) == leaves.end())
+				changed.insert(it->first);
+		}
+		for (std::set<std::pair<int, int> >::const_iterator it = changed.begin(); it != changed.end(); ++it)
+		{
+			for (int level = maxLevel; level >= 0; level--)
+			{
+				NodeKey key = nodeKey(level, it->first, it->second, maxDim);
+				if (known.tiles[key] == 0)
+					removed.insert(key);
+				known.tiles[key] = REBUILD;
+			}
+		}
+		std::cout << "Changed tiles: " << changed.size() << std::endl;
+	}
+	else
+	{
+		// Everything is built, but subtrees without tiles aren't even visited
+		known.exhaustive = true;
+		for (LeafMap::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+		{
+			for (int level = maxLevel; level >= 0; level--)
+				known.tiles[nodeKey(level, it->first.first, it->first.second, maxDim)] = REBUILD;
+		}
+	}
 
-	Image im(tileSizeX, tileSizeY);
-	std::ostringstream of;
-	std::string out(argv[2]);
-
-	buildPyramid(baseName, out, &im, 0,0, maxDim, maxDim, 0, maxDim, true);
-	buildPyramid(baseName, out, &im, -maxDim,0, 0, maxDim, 0, maxDim, true);
-	buildPyramid(baseName, out, &im, -maxDim,-maxDim, 0,0, 0, maxDim, true);
-	buildPyramid(baseName, out, &im, 0,-maxDim, maxDim, 0, 0, maxDim, true);
-
-
-
-	outputLeafletCode(out, maxLevel, tileSizeX);
-	return 0;
-
-}
-
-
-
-
-
-
-static char const *leafletMapHtml =
-"<!DOCTYPE html>\n"
-"<html>\n"
-"<head>\n"
-"\t<title>MinetestMapper</title>\n"
-"\t<meta charset=\"utf-8\" />\n"
-"\t<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
-"\t<!-- link rel=\"shortcut icon\" type=\"image/x-icon\" href=\"favicon.ico\" /-->\n"
-"\t<link rel=\"stylesheet\" href=\"leaflet.css\" integrity=\"sha512-puBpdR0798OZvTTbP4A8Ix/l+A4dHDD0DGqYW6RQ+9jxkRFclaxxQb/SJAWZfWAkuyeQUytO7+7N4QKrDh+drA==\" crossorigin=\"\"/>\n"
-"\t<script src=\"leaflet.js\" integrity=\"sha512-nMMmRyTVoLYqjP9hrbed9S+FzjZHW5gY1TWCHA5ckwXZBadntCNs8kEqAWdrb9O7rxbCaA4lKTIWjDXZxflOcA==\" crossorigin=\"\"></script>\n"
-"\t<style> .labelclass{position: absolute; background: rgba(255,0,255,0); font-size:20px;}</style>\n"
-"</head>\n"
-"<body>\n"
-"<div id=\"mapid\" style=\"width: 90vw; height: 90vh;\"></div>\n"
-"<script>\n"
-"\tvar MineTestMap = L.map('mapid', {\n"
-"\tcrs: L.CRS.Simple,\n"
-"\t});\n"
-"\tMineTestMap.setView([0.0, 0.0], %d);\n"
-"\tL.tileLayer('{z}_{x}_{y}_%s', {\n"
-"\t\tminNativeZoom: 0,\n"
-"\t\tmaxNativeZoom: %d,\n"
-"\t\tattribution: 'Minetest World',\n"
-"\t\ttileSize: %d,\n"
-"\t\terrorTileUrl: \"empty_tile_%s\",\n"
-"\t\t}).addTo(MineTestMap);\n"
-"\tvar popup = L.popup();\n"
-"\tvar mapZoom = %f;\n"
-"\tfunction onMapClick(e) {\n"
-"\t\tvar scaledPos = L.latLng(e.latlng.lat / mapZoom, e.latlng.lng / mapZoom);\n"
-"\t\tpopup\n"
-"\t\t\t.setLatLng(e.latlng)\n"
-"\t\t\t.setContent(\"You clicked the map at \"+ scaledPos.toString())\n"
-"\t\t\t.openOn(MineTestMap);\n"
-"\t}\n"
-"\tMineTestMap.on('click', onMapClick);\n"
-"</script>\n"
-"<script src=\"markers.js\" defer></script>"
-"</body>\n"
-"</html>\n";
-
-
-void outputLeafletCode(std::string const &output, int maxLevel, int tileSize)
-{
-
+	// Cut the four quadrants into enough subtrees to keep every core busy
+	// when most of them are empty. Only the levels above are built after
+	// them, from their saved images, so just the tiles in flight are kept.
+	int numThreads = 1;
+#if __cplusplus >= 201103L
+	numThreads = std::max(1U, std::thread::hardware_concurrency());
+#endif
+	int splitLevel = 0;
+	while (splitLevel < maxLevel && (1 << (2 * splitLevel)) < 16 * numThreads)
+		splitLevel++;
+	int splitSize = maxDim >> splitLevel;
+
+	std::vector<Subtree> subtrees;
+	for (int y = -maxDim; y < maxDim; y += splitSize)
+	{
+		for (int x = -maxDim; x < maxDim; x += splitSize)
+		{
+			std::map<NodeKey, int>::const_iterator k = known.tiles.find(std::make_pair(splitLevel, std::make_pair(x, y)));
+			if (k == known.tiles.end() ? known.exhaustive : k->second != REBUILD)
+				continue;
+			Subtree s = { x, y, x + splitSize, y + splitSize, 0 };
+			subtrees.push_back(s);
+		}
+	}
+	buildSubtrees(baseName, out, tileSizeX, subtrees, splitLevel, splitSize, known);
 
-	std::ostringstream fn;
-	fn << output << ".html";
+	for (size_t i = 0; i < subtrees.size(); ++i)
+		known.tiles[std::make_pair(splitLevel, std::make_pair(subtrees[i].minTileX, subtrees[i].minTileY))] = subtrees[i].count;
 
-	// I use fopen instead of ostr because I need fprintf to put the correct values into the
-	// html static string above. ostream is nice and C++ and all, but formatted output handling
-	// for streams is retarded. Use the best tool for the job.
-	FILE *out = fopen(fn.str().c_str(), "w");
+	buildPyramid(baseName, out, &im, 0,0, maxDim, maxDim, 0, maxDim, true, &known);
+	buildPyramid(baseName, out, &im, -maxDim,0, 0, maxDim, 0, maxDim, true, &known);
+	buildPyramid(baseName, out, &im, -maxDim,-maxDim, 0,0, 0, maxDim, true, &known);
+	buildPyramid(baseName, out, &im, 0,-maxDim, maxDim, 0, 0, maxDim, true, &known);
 
-	if (!out)
+	// Pyramid tiles whose tiles are all gone
+	for (std::set<NodeKey>::const_iterator it = removed.begin(); it != removed.end(); ++it)
 	{
-		std::cout << "error opening file:" << fn.str() << std::endl;
-		return;
+		// The bottom level is the tiles themselves, they're gone already
+		if ((container || !layout.empty()) && it->first == bottomLevel)
+			continue;
+		if (container)
+			container->remove(pyramidTileKey(it->first, it->second.first, it->second.second, maxDim >> it->first));
+		else
+			remove(pyramidFileName(out, it->first, it->second.first, it->second.second, maxDim >> it->first, true).c_str());
 	}
+	// Committed before the state says the pyramid is current
+	delete container;
+	writeState(stateName, maxLevel, tileSizeX, baseName, leaves);
+
+
+
+	std::string tileUrl = defaultTileUrl(out);
+	if (!containerType.empty())
+		tileUrl = "tiles/{z}/{x}/{y}";
+	else if (!layout.empty())
+		tileUrl = layout;
+	outputLeafletCode(out, maxLevel, tileSizeX, tileUrl, markerDir);
+	std::vector<std::pair<int, int> > tiles;
+	for (LeafMap::const_iterator it = leaves.begin(); it != leaves.end(); ++it)
+		tiles.push_back(it->first);
+	writeTileIndex(out, maxLevel, tiles);
+	return 0;
 
-	fprintf(out, leafletMapHtml, maxLevel, output.c_str(), maxLevel, tileSize, output.c_str(), 1.0/pow(2,maxLevel));
-
-	fclose(out);
 }
-
-
@@ -0,0 +1,205 @@
+#include <cstring>
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "db-dump.h"
+#include "types.h"
+
+/*
+ * File layout, all numbers big endian:
+ *   header: magic, u32 version, u64 number of blocks, u64 offset of the index
+ *   the block data, stored as-is from the backend, one block after another
+ *   index:  per block s16 x, s16 y, s16 z, u16 reserved, u64 offset of its data
+ * Index entries are in the same order as the data, so a block ends where
+ * the next one starts, and the last one where the index starts.
+ */
+#define DUMP_MAGIC "MTMD"
+#define DUMP_VERSION 1
+#define DUMP_HEADER_SIZE 24
+#define DUMP_ENTRY_SIZE 16
+
+static inline void writeU16(unsigned char *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline uint16_t readU16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static inline void writeU32(unsigned char *p, uint32_t v)
+{
+	writeU16(p, v >> 16);
+	writeU16(p + 2, v);
+}
+
+static inline uint32_t readU32(const unsigned char *p)
+{
+	return (uint32_t) readU16(p) << 16 | readU16(p + 2);
+}
+
+static inline void writeU64(unsigned char *p, uint64_t v)
+{
+	writeU32(p, v >> 32);
+	writeU32(p + 4, v);
+}
+
+static inline uint64_t readU64(const unsigned char *p)
+{
+	return (uint64_t) readU32(p) << 32 | readU32(p + 4);
+}
+
+
+DBDump::DBDump(const std::string &mapdir)
+{
+	std::string fileName = mapdir + "map.dump";
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw std::runtime_error("Failed to open " + fileName);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < DUMP_HEADER_SIZE) {
+		close(fd);
+		throw std::runtime_error("Invalid map dump " + fileName);
+	}
+	size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("Failed to map " + fileName);
+	data = static_cast<const unsigned char *>(map);
+
+	count = readU64(data + 8);
+	indexOffset = readU64(data + 16);
+	if (memcmp(data, DUMP_MAGIC, 4) != 0 || readU32(data + 4) != DUMP_VERSION ||
+			indexOffset < DUMP_HEADER_SIZE || indexOffset > size ||
+			count > (size - indexOffset) / DUMP_ENTRY_SIZE) {
+		munmap(map, size);
+		throw std::runtime_error("Invalid map dump " + fileName);
+	}
+	index = data + indexOffset;
+}
+
+
+DBDump::~DBDump()
+{
+	munmap(const_cast<unsigned char *>(data), size);
+}
+
+
+inline BlockPos DBDump::entryPos(uint64_t i) const
+{
+	const unsigned char *entry = index + i * DUMP_ENTRY_SIZE;
+	return BlockPos(readU16(entry), readU16(entry + 2), readU16(entry + 4));
+}
+
+
+inline uint64_t DBDump::entryOffset(uint64_t i) const
+{
+	return i < count ? readU64(index + i * DUMP_ENTRY_SIZE + 8) : indexOffset;
+}
+
+
+std::vector<BlockPos> DBDump::getBlockPos()
+{
+	std::vector<BlockPos> positions;
+	positions.reserve(count);
+	for (uint64_t i = 0; i < count; ++i)
+		positions.push_back(entryPos(i));
+	return positions;
+}
+
+
+void DBDump::getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos)
+{
+	// First entry of the row
+	uint64_t first = 0, last = count;
+	while (first < last) {
+		uint64_t middle = first + (last - first) / 2;
+		if (entryPos(middle).z < zPos)
+			first = middle + 1;
+		else
+			last = middle;
+	}
+
+	for (uint64_t i = first; i < count; ++i) {
+		BlockPos pos = entryPos(i);
+		if (pos.z != zPos)
+			break;
+		uint64_t begin = entryOffset(i);
+		uint64_t end = entryOffset(i + 1);
+		if (begin < DUMP_HEADER_SIZE || begin > end || end > indexOffset)
+			throw std::runtime_error("Invalid block offset in map dump");
+		blocks[pos.x].push_back(Block(pos, ustring(data + begin, end - begin)));
+	}
+}
+
+
+void DBDump::scanBlocks(BlockVisitor &visitor)
+{
+	for (uint64_t i = 0; i < count; ++i) {
+		uint64_t begin = entryOffset(i);
+		uint64_t end = entryOffset(i + 1);
+		if (begin < DUMP_HEADER_SIZE || begin > end || end > indexOffset)
+			throw std::runtime_error("Invalid block offset in map dump");
+		visitor.visit(entryPos(i), ustring(data + begin, end - begin));
+	}
+}
+
+
+void DBDump::write(DB &source, const std::string &fileName)
+{
+	std::ofstream out(fileName.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out.is_open())
+		throw std::runtime_error("Failed to open " + fileName);
+
+	std::set<int16_t> zSet;
+	std::vector<BlockPos> positions = source.getBlockPos();
+	for (std::vector<BlockPos>::const_iterator it = positions.begin(); it != positions.end(); ++it)
+		zSet.insert(it->z);
+	std::list<int> zPositions(zSet.begin(), zSet.end());
+	source.prefetchBlocksOnZ(zPositions);
+
+	unsigned char header[DUMP_HEADER_SIZE] = {0};
+	out.write(reinterpret_cast<char *>(header), sizeof(header));
+
+	// The index is only a few bytes per block, keep it until the data is written
+	std::vector<unsigned char> index;
+	uint64_t offset = DUMP_HEADER_SIZE;
+	for (std::list<int>::const_iterator z = zPositions.begin(); z != zPositions.end(); ++z) {
+		std::map<int16_t, BlockList> blocks;
+		source.getBlocksOnZ(blocks, *z);
+		for (std::map<int16_t, BlockList>::iterator x = blocks.begin(); x != blocks.end(); ++x) {
+			x->second.sort(); // from the top down
+			for (BlockList::const_iterator block = x->second.begin(); block != x->second.end(); ++block) {
+				unsigned char entry[DUMP_ENTRY_SIZE] = {0};
+				writeU16(entry, block->first.x);
+				writeU16(entry + 2, block->first.y);
+				writeU16(entry + 4, block->first.z);
+				writeU64(entry + 8, offset);
+				index.insert(index.end(), entry, entry + sizeof(entry));
+
+				const ustring &blockData = block->second;
+				out.write(reinterpret_cast<const char *>(blockData.data()), blockData.size());
+				offset += blockData.size();
+			}
+		}
+	}
+	if (!index.empty())
+		out.write(reinterpret_cast<char *>(&index[0]), index.size());
+
+	memcpy(header, DUMP_MAGIC, 4);
+	writeU32(header + 4, DUMP_VERSION);
+	writeU64(header + 8, index.size() / DUMP_ENTRY_SIZE);
+	writeU64(header + 16, offset);
+	out.seekp(0);
+	out.write(reinterpret_cast<char *>(header), sizeof(header));
+	out.close();
+	if (out.fail())
+		throw std::runtime_error("Failed to write " + fileName);
+}
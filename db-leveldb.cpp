@@ -1,8 +1,12 @@
 #include <stdexcept>
 #include <sstream>
+#include <algorithm>
 #include "db-leveldb.h"
 #include "types.h"
 
+// Position hashes have at most this many digits (without the sign)
+#define DB_LEVELDB_MAX_DIGITS 11
+
 static inline int64_t stoi64(const std::string &s)
 {
 	std::stringstream tmp(s);
@@ -28,28 +32,38 @@ DBLevelDB::DBLevelDB(const std::string &mapdir)
 		throw std::runtime_error(std::string("Failed to open Database: ") + status.ToString());
 	}
 
+	// Read everything from one consistent view, even if a server is
+	// writing to the database meanwhile. The mapper reads every block
+	// only once, so don't let it push the server's data out of the cache.
+	snapshot = db->GetSnapshot();
+	readOptions.snapshot = snapshot;
+	readOptions.fill_cache = false;
+
 	loadPosCache();
 }
 
 
 DBLevelDB::~DBLevelDB()
 {
+	db->ReleaseSnapshot(snapshot);
 	delete db;
 }
 
 
 std::vector<BlockPos> DBLevelDB::getBlockPos()
 {
-	return posCache;
+	std::vector<BlockPos> positions;
+	getIndexedPos(positions);
+	return positions;
 }
 
 
 void DBLevelDB::loadPosCache()
 {
-	leveldb::Iterator * it = db->NewIterator(leveldb::ReadOptions());
+	leveldb::Iterator * it = db->NewIterator(readOptions);
 	for (it->SeekToFirst(); it->Valid(); it->Next()) {
 		int64_t posHash = stoi64(it->key().ToString());
-		posCache.push_back(decodeBlockPos(posHash));
+		indexBlockPos(decodeBlockPos(posHash));
 	}
 	delete it;
 }
@@ -57,18 +71,78 @@ void DBLevelDB::loadPosCache()
 
 void DBLevelDB::getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos)
 {
-	std::string datastr;
-	leveldb::Status status;
+	// Magic numbers!
+	int64_t minPos = encodeBlockPos(BlockPos(-2048, -2048, zPos));
+	int64_t maxPos = encodeBlockPos(BlockPos(2047, 2047, zPos));
+
+	leveldb::Iterator * it = db->NewIterator(readOptions);
+	int64_t groupMin = 1;
+	for (int digits = 1; digits <= DB_LEVELDB_MAX_DIGITS; ++digits, groupMin *= 10) {
+		int64_t groupMax = groupMin * 10 - 1;
+		scanKeys(it, false, digits, std::max(minPos, digits == 1 ? 0 : groupMin),
+			std::min(maxPos, groupMax), blocks, zPos);
+		scanKeys(it, true, digits, std::max(-maxPos, groupMin),
+			std::min(-minPos, groupMax), blocks, zPos);
+	}
+	delete it;
+}
+
+
+void DBLevelDB::scanBlocks(BlockVisitor &visitor)
+{
+	leveldb::Iterator * it = db->NewIterator(readOptions);
+	for (it->SeekToFirst(); it->Valid(); it->Next()) {
+		BlockPos pos = decodeBlockPos(stoi64(it->key().ToString()));
+		const leveldb::Slice &value = it->value();
+		visitor.visit(pos, ustring((const unsigned char *) value.data(), value.size()));
+	}
+	delete it;
+}
+
+
+/*
+ * Keys are decimal strings, so LevelDB sorts them lexically. Keys with the
+ * same sign and number of digits do sort by their absolute value though,
+ * so all keys of such a group that lie in a range of positions are stored
+ * next to each other and can be read in one sequential pass. Keys of other
+ * lengths that sort in between are skipped.
+ */
+void DBLevelDB::scanKeys(leveldb::Iterator *it, bool negative, int digits,
+		int64_t absMin, int64_t absMax,
+		std::map<int16_t, BlockList> &blocks, int16_t zPos)
+{
+	if (absMin > absMax)
+		return;
 
-	for (std::vector<BlockPos>::iterator it = posCache.begin(); it != posCache.end(); ++it) {
-		if (it->z != zPos) {
+	const std::string prefix = negative ? "-" : "";
+	const std::string last = prefix + i64tos(absMax);
+	for (it->Seek(prefix + i64tos(absMin)); it->Valid(); ) {
+		leveldb::Slice key = it->key();
+		if (key.compare(last) > 0)
+			break;
+		int length = key.size() - prefix.size();
+		if (length < digits) {
+			// shorter key that sorts into our range
+			it->Next();
 			continue;
 		}
-		status = db->Get(leveldb::ReadOptions(), i64tos(encodeBlockPos(*it)), &datastr);
-		if (status.ok()) {
-			Block b(*it, ustring((const unsigned char *) datastr.data(), datastr.size()));
-			blocks[b.first.x].push_back(b);
+
+		int64_t absValue = 0;
+		for (int i = 0; i < digits; ++i)
+			absValue = absValue * 10 + (key[prefix.size() + i] - '0');
+		if (length > digits) {
+			// longer keys sharing our leading digits, jump over all of them
+			it->Seek(prefix + i64tos(absValue + 1));
+			continue;
+		}
+
+		BlockPos pos = decodeBlockPos(negative ? -absValue : absValue);
+		if (pos.z == zPos) {
+			leveldb::Slice value = it->value();
+			Block b(pos, ustring((const unsigned char *) value.data(), value.size()));
+			blocks[pos.x].push_back(b);
 		}
+		it->Next();
 	}
 }
 
@@ -9,38 +9,82 @@
 
 #define ARRLEN(x) (sizeof(x) / sizeof((x)[0]))
 
+// Rows per batch when libpq supports chunked result mode
+#define DB_POSTGRESQL_CHUNK_ROWS 256
+
+// Extra connections used to fetch announced Z rows ahead of time
+#define DB_POSTGRESQL_POOL_SIZE "4"
+
 DBPostgreSQL::DBPostgreSQL(const std::string &mapdir)
 {
 	std::ifstream ifs((mapdir + "/world.mt").c_str());
 	if(!ifs.good())
 		throw std::runtime_error("Failed to read world.mt");
 	std::string connect_string = read_setting("pgsql_connection", ifs);
+	ifs.seekg(0);
+	int poolSize = atoi(read_setting_default("pgsql_mapper_connections", ifs,
+		DB_POSTGRESQL_POOL_SIZE).c_str());
 	ifs.close();
-	db = PQconnectdb(connect_string.c_str());
-
-	if (PQstatus(db) != CONNECTION_OK) {
-		throw std::runtime_error(std::string(
-			"PostgreSQL database error: ") +
-			PQerrorMessage(db)
-		);
-	}
+	db = connectDb(connect_string);
 
 	prepareStatement(
+		db,
 		"get_block_pos",
 		"SELECT posX, posY, posZ FROM blocks"
 	);
 	prepareStatement(
+		db,
 		"get_blocks_z",
 		"SELECT posX, posY, data FROM blocks WHERE posZ = $1::int4"
 	);
+	prepareStatement(
+		db,
+		"get_blocks",
+		"SELECT posX, posY, posZ, data FROM blocks"
+	);
 
 	checkResults(PQexec(db, "START TRANSACTION;"));
 	checkResults(PQexec(db, "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ;"));
+
+	if (poolSize <= 0)
+		return;
+
+	// Let the prefetch connections see exactly the same data as this one
+	PGresult *res = checkResults(PQexec(db, "SELECT pg_export_snapshot();"), false);
+	char *snapshot = PQescapeLiteral(db, PQgetvalue(res, 0, 0),
+		PQgetlength(res, 0, 0));
+	PQclear(res);
+	if (!snapshot) {
+		throw std::runtime_error(std::string(
+			"PostgreSQL database error: ") +
+			PQerrorMessage(db)
+		);
+	}
+	std::string setSnapshot = std::string("SET TRANSACTION SNAPSHOT ") + snapshot + ";";
+	PQfreemem(snapshot);
+
+	for (int i = 0; i < poolSize; ++i) {
+		PGconn *conn = connectDb(connect_string);
+		pool.push_back(conn);
+		idle.push_back(conn);
+
+		prepareStatement(
+			conn,
+			"get_blocks_z",
+			"SELECT posX, posY, data FROM blocks WHERE posZ = $1::int4"
+		);
+		checkResults(PQexec(conn, "START TRANSACTION ISOLATION LEVEL REPEATABLE READ, READ ONLY;"));
+		checkResults(PQexec(conn, setSnapshot.c_str()));
+	}
 }
 
 
 DBPostgreSQL::~DBPostgreSQL()
 {
+	// Prefetch connections are read only, dropping them rolls back
+	for (std::vector<PGconn *>::iterator it = pool.begin(); it != pool.end(); ++it)
+		PQfinish(*it);
+
 	try {
 		checkResults(PQexec(db, "COMMIT;"));
 	} catch (std::exception& caught) {
@@ -53,23 +97,103 @@ std::vector<BlockPos> DBPostgreSQL::getBlockPos()
 {
 	std::vector<BlockPos> positions;
 
-	PGresult *results = execPrepared(
-		"get_block_pos", 0,
-		NULL, NULL, NULL, false, false
-	);
+	streamPrepared(db, "get_block_pos", 0, NULL);
 
-	int numrows = PQntuples(results);
+	PGresult *results;
+	while ((results = streamNext(db)) != NULL) {
+		int numrows = PQntuples(results);
 
-	for (int row = 0; row < numrows; ++row)
-		positions.push_back(pg_to_blockpos(results, row, 0));
+		for (int row = 0; row < numrows; ++row)
+			positions.push_back(pg_binary_to_blockpos(results, row, 0));
 
-	PQclear(results);
+		PQclear(results);
+	}
 
 	return positions;
 }
 
 
 void DBPostgreSQL::getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos)
+{
+	std::map<int16_t, PGconn *>::iterator it = inFlight.find(zPos);
+	if (it == inFlight.end()) {
+		// Not announced (or not sent yet), query it directly
+		for (std::deque<int16_t>::iterator q = pending.begin(); q != pending.end(); ++q) {
+			if (*q == zPos) {
+				pending.erase(q);
+				break;
+			}
+		}
+		sendBlocksOnZ(db, zPos);
+		readBlocksOnZ(db, blocks, zPos);
+		return;
+	}
+
+	PGconn *conn = it->second;
+	inFlight.erase(it);
+	readBlocksOnZ(conn, blocks, zPos);
+	idle.push_back(conn);
+	sendPending();
+}
+
+
+void DBPostgreSQL::scanBlocks(BlockVisitor &visitor)
+{
+	// One sequential scan, streamed to keep the memory use flat
+	streamPrepared(db, "get_blocks", 0, NULL);
+
+	PGresult *results;
+	while ((results = streamNext(db)) != NULL) {
+		int numrows = PQntuples(results);
+
+		for (int row = 0; row < numrows; ++row) {
+			visitor.visit(
+				pg_binary_to_blockpos(results, row, 0),
+				ustring(
+					reinterpret_cast<unsigned char*>(
+						PQgetvalue(results, row, 3)
+					),
+					PQgetlength(results, row, 3)
+				)
+			);
+		}
+
+		PQclear(results);
+	}
+}
+
+
+void DBPostgreSQL::prefetchBlocksOnZ(const std::list<int> &zPositions)
+{
+	if (pool.empty())
+		return;
+
+	pending.clear();
+	for (std::list<int>::const_iterator it = zPositions.begin(); it != zPositions.end(); ++it) {
+		if (inFlight.find(*it) == inFlight.end())
+			pending.push_back(*it);
+	}
+	sendPending();
+}
+
+
+void DBPostgreSQL::sendPending()
+{
+	while (!idle.empty() && !pending.empty()) {
+		int16_t zPos = pending.front();
+		pending.pop_front();
+		if (inFlight.find(zPos) != inFlight.end())
+			continue;
+
+		PGconn *conn = idle.back();
+		idle.pop_back();
+		sendBlocksOnZ(conn, zPos);
+		inFlight[zPos] = conn;
+	}
+}
+
+
+void DBPostgreSQL::sendBlocksOnZ(PGconn *conn, int16_t zPos)
 {
 	int32_t const z = htonl(zPos);
 
@@ -77,31 +201,50 @@ void DBPostgreSQL::getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zP
 	const int argLen[] = { sizeof(z) };
 	const int argFmt[] = { 1 };
 
-	PGresult *results = execPrepared(
-		"get_blocks_z", ARRLEN(args), args,
-		argLen, argFmt, false
-	);
+	streamPrepared(conn, "get_blocks_z", ARRLEN(args), args, argLen, argFmt);
+}
 
-	int numrows = PQntuples(results);
-
-	for (int row = 0; row < numrows; ++row) {
-		BlockPos position;
-		position.x = pg_binary_to_int(results, row, 0);
-		position.y = pg_binary_to_int(results, row, 1);
-		position.z = zPos;
-		Block const b(
-			position,
-			ustring(
-				reinterpret_cast<unsigned char*>(
-					PQgetvalue(results, row, 2)
-				),
-				PQgetlength(results, row, 2)
-			)
-		);
-		blocks[position.x].push_back(b);
+
+void DBPostgreSQL::readBlocksOnZ(PGconn *conn, std::map<int16_t, BlockList> &blocks, int16_t zPos)
+{
+	PGresult *results;
+	while ((results = streamNext(conn)) != NULL) {
+		int numrows = PQntuples(results);
+
+		for (int row = 0; row < numrows; ++row) {
+			BlockPos position;
+			position.x = pg_binary_to_int(results, row, 0);
+			position.y = pg_binary_to_int(results, row, 1);
+			position.z = zPos;
+			Block const b(
+				position,
+				ustring(
+					reinterpret_cast<unsigned char*>(
+						PQgetvalue(results, row, 2)
+					),
+					PQgetlength(results, row, 2)
+				)
+			);
+			blocks[position.x].push_back(b);
+		}
+
+		PQclear(results);
+	}
+}
+
+PGconn *DBPostgreSQL::connectDb(const std::string &connect_string)
+{
+	PGconn *conn = PQconnectdb(connect_string.c_str());
+
+	if (PQstatus(conn) != CONNECTION_OK) {
+		std::string err = std::string(
+			"PostgreSQL database error: ") +
+			PQerrorMessage(conn);
+		PQfinish(conn);
+		throw std::runtime_error(err);
 	}
 
-	PQclear(results);
+	return conn;
 }
 
 PGresult *DBPostgreSQL::checkResults(PGresult *res, bool clear)
@@ -111,6 +254,10 @@ PGresult *DBPostgreSQL::checkResults(PGresult *res, bool clear)
 	switch (statusType) {
 	case PGRES_COMMAND_OK:
 	case PGRES_TUPLES_OK:
+	case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	case PGRES_TUPLES_CHUNK:
+#endif
 		break;
 	case PGRES_FATAL_ERROR:
 		throw std::runtime_error(
@@ -129,9 +276,9 @@ PGresult *DBPostgreSQL::checkResults(PGresult *res, bool clear)
 	return res;
 }
 
-void DBPostgreSQL::prepareStatement(const std::string &name, const std::string &sql)
+void DBPostgreSQL::prepareStatement(PGconn *conn, const std::string &name, const std::string &sql)
 {
-	checkResults(PQprepare(db, name.c_str(), sql.c_str(), 0, NULL));
+	checkResults(PQprepare(conn, name.c_str(), sql.c_str(), 0, NULL));
 }
 
 PGresult *DBPostgreSQL::execPrepared(
@@ -147,6 +294,46 @@ PGresult *DBPostgreSQL::execPrepared(
 	);
 }
 
+void DBPostgreSQL::streamPrepared(
+	PGconn *conn, const char *stmtName, const int paramsNumber,
+	const void **params,
+	const int *paramsLengths, const int *paramsFormats,
+	bool nobinary
+)
+{
+	if (!PQsendQueryPrepared(conn, stmtName, paramsNumber,
+			(const char* const*) params, paramsLengths, paramsFormats,
+			nobinary ? 1 : 0)) {
+		throw std::runtime_error(std::string(
+			"PostgreSQL database error: ") +
+			PQerrorMessage(conn)
+		);
+	}
+
+	// Hand out the rows in small batches as they arrive instead of
+	// buffering the whole result set inside libpq
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	if (!PQsetChunkedRowsMode(conn, DB_POSTGRESQL_CHUNK_ROWS))
+#else
+	if (!PQsetSingleRowMode(conn))
+#endif
+		std::cerr << "Failed to enable row streaming, "
+			"falling back to buffered results" << std::endl;
+}
+
+PGresult *DBPostgreSQL::streamNext(PGconn *conn)
+{
+	PGresult *res;
+	while ((res = PQgetResult(conn)) != NULL) {
+		checkResults(res, false);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) > 0)
+			return res;
+		// empty terminating result of a streamed query
+		PQclear(res);
+	}
+	return NULL;
+}
+
 int DBPostgreSQL::pg_to_int(PGresult *res, int row, int col)
 {
 	return atoi(PQgetvalue(res, row, col));
@@ -166,3 +353,12 @@ BlockPos DBPostgreSQL::pg_to_blockpos(PGresult *res, int row, int col)
 	result.z = pg_to_int(res, row, col + 2);
 	return result;
 }
+
+BlockPos DBPostgreSQL::pg_binary_to_blockpos(PGresult *res, int row, int col)
+{
+	BlockPos result;
+	result.x = pg_binary_to_int(res, row, col);
+	result.y = pg_binary_to_int(res, row, col + 1);
+	result.z = pg_binary_to_int(res, row, col + 2);
+	return result;
+}
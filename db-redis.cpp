@@ -1,11 +1,21 @@
+#include <algorithm>
 #include <stdexcept>
 #include <sstream>
 #include <fstream>
+#include <deque>
 #include "db-redis.h"
 #include "types.h"
 #include "util.h"
 
+// Number of fields in the first HMGET, later ones aim for a reply size
 #define DB_REDIS_HMGET_NUMFIELDS 30
+#define DB_REDIS_HMGET_MIN_FIELDS 16
+#define DB_REDIS_HMGET_MAX_FIELDS 1024
+#define DB_REDIS_HMGET_REPLY_SIZE (256 * 1024)
+// HMGET commands sent ahead of the reply being processed
+#define DB_REDIS_HMGET_PIPELINE 16
+// Hint for the number of keys per HSCAN step
+#define DB_REDIS_HSCAN_COUNT 1000
 
 #define REPLY_TYPE_ERR(reply, desc) do { \
 	throw std::runtime_error(std::string("Unexpected type for " desc ": ") \
@@ -28,7 +38,8 @@ static inline std::string i64tos(int64_t i)
 	return os.str();
 }
 
-DBRedis::DBRedis(const std::string &mapdir)
+DBRedis::DBRedis(const std::string &mapdir) :
+	hmgetNumFields(DB_REDIS_HMGET_NUMFIELDS)
 {
 	std::ifstream ifs((mapdir + "/world.mt").c_str());
 	if(!ifs.good())
@@ -63,7 +74,9 @@ DBRedis::~DBRedis()
 
 std::vector<BlockPos> DBRedis::getBlockPos()
 {
-	return posCache;
+	std::vector<BlockPos> positions;
+	getIndexedPos(positions);
+	return positions;
 }
 
 
@@ -88,6 +101,55 @@ std::string DBRedis::replyTypeStr(int type) {
 
 
 void DBRedis::loadPosCache()
+{
+	// Walk the hash incrementally, so a large world doesn't block the
+	// server for the time it takes to list all keys at once.
+	std::string cursor = "0";
+	while (true) {
+		redisReply *reply;
+		reply = (redisReply*) redisCommand(ctx, "HSCAN %s %s COUNT %d NOVALUES",
+			hash.c_str(), cursor.c_str(), DB_REDIS_HSCAN_COUNT);
+		if(!reply)
+			throw std::runtime_error("Redis command HSCAN failed");
+		if(reply->type == REDIS_REPLY_ERROR && cursor == "0") {
+			// NOVALUES needs Redis 7.4, without it HSCAN would send every
+			// block along, HKEYS only sends the keys
+			freeReplyObject(reply);
+			loadPosCacheAtOnce();
+			return;
+		}
+		if(reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+			REPLY_TYPE_ERR(reply, "HSCAN reply");
+		if(reply->element[0]->type != REDIS_REPLY_STRING)
+			REPLY_TYPE_ERR(reply->element[0], "HSCAN cursor");
+		if(reply->element[1]->type != REDIS_REPLY_ARRAY)
+			REPLY_TYPE_ERR(reply->element[1], "HSCAN keys");
+
+		redisReply *keys = reply->element[1];
+		for(size_t i = 0; i < keys->elements; i++) {
+			if(keys->element[i]->type != REDIS_REPLY_STRING)
+				REPLY_TYPE_ERR(keys->element[i], "HSCAN subreply");
+			indexBlockPos(decodeBlockPos(stoi64(keys->element[i]->str)));
+		}
+
+		cursor = std::string(reply->element[0]->str, reply->element[0]->len);
+		freeReplyObject(reply);
+		if(cursor == "0")
+			break;
+	}
+
+	// HSCAN may return a field more than once
+	for (PosIndex::iterator row = posIndex.begin(); row != posIndex.end(); ++row) {
+		for (PosIndexRow::iterator column = row->second.begin(); column != row->second.end(); ++column) {
+			std::vector<int16_t> &ys = column->second;
+			std::sort(ys.begin(), ys.end());
+			ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+		}
+	}
+}
+
+
+void DBRedis::loadPosCacheAtOnce()
 {
 	redisReply *reply;
 	reply = (redisReply*) redisCommand(ctx, "HKEYS %s", hash.c_str());
@@ -98,62 +160,109 @@ void DBRedis::loadPosCache()
 	for(size_t i = 0; i < reply->elements; i++) {
 		if(reply->element[i]->type != REDIS_REPLY_STRING)
 			REPLY_TYPE_ERR(reply->element[i], "HKEYS subreply");
-		posCache.push_back(decodeBlockPos(stoi64(reply->element[i]->str)));
+		indexBlockPos(decodeBlockPos(stoi64(reply->element[i]->str)));
 	}
 
 	freeReplyObject(reply);
 }
 
 
+void DBRedis::scanBlocks(BlockVisitor &visitor)
+{
+	// HSCAN may return a field more than once, visiting it twice is allowed
+	std::string cursor = "0";
+	do {
+		redisReply *reply = (redisReply*) redisCommand(ctx, "HSCAN %s %s COUNT %d",
+			hash.c_str(), cursor.c_str(), DB_REDIS_HSCAN_COUNT);
+		if(!reply)
+			throw std::runtime_error("Redis command HSCAN failed");
+		if(reply->type != REDIS_REPLY_ARRAY || reply->elements != 2)
+			REPLY_TYPE_ERR(reply, "HSCAN reply");
+		if(reply->element[0]->type != REDIS_REPLY_STRING)
+			REPLY_TYPE_ERR(reply->element[0], "HSCAN cursor");
+		if(reply->element[1]->type != REDIS_REPLY_ARRAY)
+			REPLY_TYPE_ERR(reply->element[1], "HSCAN keys");
+
+		redisReply *fields = reply->element[1];
+		for(size_t i = 0; i + 1 < fields->elements; i += 2) {
+			redisReply *key = fields->element[i], *value = fields->element[i + 1];
+			if(key->type != REDIS_REPLY_STRING)
+				REPLY_TYPE_ERR(key, "HSCAN subreply");
+			if(value->type != REDIS_REPLY_STRING)
+				REPLY_TYPE_ERR(value, "HSCAN subreply");
+			visitor.visit(decodeBlockPos(stoi64(key->str)),
+				ustring((const unsigned char *) value->str, value->len));
+		}
+
+		cursor = std::string(reply->element[0]->str, reply->element[0]->len);
+		freeReplyObject(reply);
+	} while(cursor != "0");
+}
+
+
 void DBRedis::HMGET(const std::vector<BlockPos> &positions, std::vector<ustring> *result)
 {
-	const char *argv[DB_REDIS_HMGET_NUMFIELDS + 2];
-	argv[0] = "HMGET";
-	argv[1] = hash.c_str();
+	std::vector<const char *> argv;
+	std::vector<std::string> keys;
+	std::deque<std::size_t> inFlight; // sizes of the batches sent but not answered yet
 
 	std::vector<BlockPos>::const_iterator position = positions.begin();
 	std::size_t remaining = positions.size();
-	while (remaining > 0) {
-		const std::size_t batch_size =
-			(remaining > DB_REDIS_HMGET_NUMFIELDS) ? DB_REDIS_HMGET_NUMFIELDS : remaining;
+	while (remaining > 0 || !inFlight.empty()) {
+		// Keep a number of batches queued, so the server never waits for us
+		while (remaining > 0 && inFlight.size() < DB_REDIS_HMGET_PIPELINE) {
+			const std::size_t batch_size =
+				(remaining > hmgetNumFields) ? hmgetNumFields : remaining;
 
-		redisReply *reply;
-		{
-			// storage to preserve validity of .c_str()
-			std::string keys[batch_size];
+			keys.resize(batch_size);
+			argv.resize(batch_size + 2);
+			argv[0] = "HMGET";
+			argv[1] = hash.c_str();
 			for (std::size_t i = 0; i < batch_size; ++i) {
 				keys[i] = i64tos(encodeBlockPos(*position++));
 				argv[i+2] = keys[i].c_str();
 			}
-			reply = (redisReply*) redisCommandArgv(ctx, batch_size + 2, argv, NULL);
+			if (redisAppendCommandArgv(ctx, batch_size + 2, &argv[0], NULL) != REDIS_OK)
+				throw std::runtime_error("Redis command HMGET failed");
+			inFlight.push_back(batch_size);
+			remaining -= batch_size;
 		}
 
-		if(!reply)
+		const std::size_t batch_size = inFlight.front();
+		inFlight.pop_front();
+
+		redisReply *reply;
+		if (redisGetReply(ctx, (void **) &reply) != REDIS_OK || !reply)
 			throw std::runtime_error("Redis command HMGET failed");
-		if (reply->type != REDIS_REPLY_ARRAY) {
-			freeReplyObject(reply);
-			REPLY_TYPE_ERR(reply, "HKEYS subreply");
-		}
+		if (reply->type != REDIS_REPLY_ARRAY)
+			REPLY_TYPE_ERR(reply, "HMGET reply");
 		if (reply->elements != batch_size) {
 			freeReplyObject(reply);
 			throw std::runtime_error("HMGET wrong number of elements");
 		}
+		std::size_t reply_size = 0;
 		for (std::size_t i = 0; i < batch_size; ++i) {
 			redisReply *subreply = reply->element[i];
 			if(!subreply)
 				throw std::runtime_error("Redis command HMGET failed");
-			if (subreply->type != REDIS_REPLY_STRING) {
-				freeReplyObject(reply);
-				REPLY_TYPE_ERR(reply, "HKEYS subreply");
-			}
+			if (subreply->type != REDIS_REPLY_STRING)
+				REPLY_TYPE_ERR(subreply, "HMGET subreply");
 			if (subreply->len == 0) {
 				freeReplyObject(reply);
 				throw std::runtime_error("HMGET empty string");
 			}
 			result->push_back(ustring((const unsigned char *) subreply->str, subreply->len));
+			reply_size += subreply->len;
 		}
 		freeReplyObject(reply);
-		remaining -= batch_size;
+
+		// Size the following batches after the blocks seen so far
+		std::size_t fields = DB_REDIS_HMGET_REPLY_SIZE / (reply_size / batch_size + 1);
+		if (fields < DB_REDIS_HMGET_MIN_FIELDS)
+			fields = DB_REDIS_HMGET_MIN_FIELDS;
+		if (fields > DB_REDIS_HMGET_MAX_FIELDS)
+			fields = DB_REDIS_HMGET_MAX_FIELDS;
+		hmgetNumFields = fields;
 	}
 }
 
@@ -161,12 +270,7 @@ void DBRedis::HMGET(const std::vector<BlockPos> &positions, std::vector<ustring>
 void DBRedis::getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos)
 {
 	std::vector<BlockPos> z_positions;
-	for (std::vector<BlockPos>::const_iterator it = posCache.begin(); it != posCache.end(); ++it) {
-		if (it->z != zPos) {
-			continue;
-		}
-		z_positions.push_back(*it);
-	}
+	getIndexedPosOnZ(z_positions, zPos);
 	std::vector<ustring> z_blocks;
 	HMGET(z_positions, &z_blocks);
 
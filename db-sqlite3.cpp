@@ -27,6 +27,10 @@ DBSQLite3::DBSQLite3(const std::string &mapdir)
 	SQLOK(prepare_v2(db,
 			"SELECT pos FROM blocks",
 		-1, &stmt_get_block_pos, NULL))
+
+	SQLOK(prepare_v2(db,
+			"SELECT pos, data FROM blocks",
+		-1, &stmt_get_blocks, NULL))
 }
 
 
@@ -34,6 +38,7 @@ DBSQLite3::~DBSQLite3()
 {
 	sqlite3_finalize(stmt_get_blocks_z);
 	sqlite3_finalize(stmt_get_block_pos);
+	sqlite3_finalize(stmt_get_blocks);
 
 	if (sqlite3_close(db) != SQLITE_OK) {
 		std::cerr << "Error closing SQLite database." << std::endl;
@@ -87,6 +92,26 @@ void DBSQLite3::getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos)
 	SQLOK(reset(stmt_get_blocks_z));
 }
 
+
+void DBSQLite3::scanBlocks(BlockVisitor &visitor)
+{
+	int result;
+	while ((result = sqlite3_step(stmt_get_blocks)) != SQLITE_DONE) {
+		if (result == SQLITE_ROW) {
+			int64_t posHash = sqlite3_column_int64(stmt_get_blocks, 0);
+			const unsigned char *data = reinterpret_cast<const unsigned char *>(
+					sqlite3_column_blob(stmt_get_blocks, 1));
+			size_t size = sqlite3_column_bytes(stmt_get_blocks, 1);
+			visitor.visit(decodeBlockPos(posHash), ustring(data, size));
+		} else if (result == SQLITE_BUSY) { // Wait some time and try again
+			usleep(10000);
+		} else {
+			throw std::runtime_error(sqlite3_errmsg(db));
+		}
+	}
+	SQLOK(reset(stmt_get_blocks));
+}
+
 #undef SQLRES
 #undef SQLOK
 
@@ -29,6 +29,8 @@ public:
 	void decode(const ustring &data);
 	bool isEmpty() const;
 	std::string getNode(u8 x, u8 y, u8 z) const; // returns "" for air, ignore and invalid nodes
+	int getContentId(u8 x, u8 y, u8 z) const; // returns -1 for air and ignore, may be an invalid id
+	const NameMap &getNameMap() const { return m_nameMap; }
 
 	NodeMetaData const &getNodeMetaData(u8 x, u8 y, u8 z) const;
 
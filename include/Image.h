@@ -4,6 +4,7 @@
 #include "types.h"
 #include <string>
 #include <gd.h>
+#include "PngWriter.h"
 
 typedef gdPoint ImagePoint;
 
@@ -27,6 +28,9 @@ public:
 	~Image();
 
 	void scaleBlit(Image *to, int x, int y, int w, int h) const;
+	// Halves the image into to at x, y with a 2x2 box filter, colors are
+	// weighted by their opacity. Pixels there are replaced, not blended.
+	void downsample(Image *to, int x, int y) const;
 	void blit(Image *to, int x, int y);
 	void blit(Image *to, int xs, int ys, int xd, int yd, int w, int h);
 	void setPixel(int x, int y, const Color &c);
@@ -36,14 +40,26 @@ public:
 	void drawFilledRect(int x, int y, int w, int h, const Color &c);
 	void drawFilledPolygon(int nrPoints, ImagePoint const *p, Color const &c, bool setAlpha);
 	void drawCircle(int x, int y, int diameter, const Color &c);
-	void save(const std::string &filename) const;
+	// .png files are written by PngWriter with the given options, unless
+	// useGd is set. Other formats are always written by gd.
+	void save(const std::string &filename,
+		const PngWriter::Options &options = PngWriter::Options(), bool useGd = false) const;
+	// PNG data of the image, encoded like save() does it, and back
+	std::string png(const PngWriter::Options &options = PngWriter::Options(), bool useGd = false) const;
+	static Image *fromPng(const std::string &data);
 	void fill(const Color &c, bool setAlpha = false);
+	Image *clone() const;
+	// Whether other has the same size and pixels, it may be a palette image
+	bool samePixels(const Image &other) const;
 
+	// gd truecolor pixels, GetHeight() rows of GetWidth()
+	inline const int *const *pixels() const { return m_image->tpixels; }
 	inline int GetHeight() { return m_height; }
 	inline int GetWidth() { return m_width; }
 	void crop(int x1, int y1, int x2, int y2);
 private:
 	Image(const Image&);
+	Image(gdImagePtr image);
 
 	int m_width, m_height;
 	gdImagePtr m_image;
@@ -0,0 +1,76 @@
+#ifndef NODEFINDER_HEADER
+#define NODEFINDER_HEADER
+
+#include <iostream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#endif
+
+#include "BlockDecoder.h"
+#include "db.h"
+
+/*
+ * Looks at every node of the blocks it visits, not only the visible ones,
+ * and writes each node with one of the names as a line of JSON with its
+ * position and metadata. Names are matched by the content ids of each
+ * block's name mapping, a block mapping none of them is dropped without
+ * looking at its nodes. Blocks are searched on background threads, the
+ * lines of a block are written together but blocks in no particular order.
+ * Without C++11 blocks are searched right away.
+ */
+class NodeFinder : public DB::BlockVisitor
+{
+public:
+	NodeFinder(std::ostream &out);
+	~NodeFinder();
+
+	void addName(const std::string &name);
+	// Block columns xMin <= x < xMax, zMin <= z < zMax, node heights yMin to yMax
+	void setArea(int xMin, int xMax, int zMin, int zMax, int yMin, int yMax);
+	// Blocks while the queue is full
+	virtual void visit(const BlockPos &pos, const ustring &data);
+	// Wait for every queued block, throws the first error that occurred
+	void finish();
+
+	size_t blocksSearched() const { return m_blocksSearched; }
+	size_t blocksRejected() const { return m_blocksRejected; }
+	size_t nodesFound() const { return m_nodesFound; }
+
+private:
+	NodeFinder(const NodeFinder &);
+	// Appends a line for each node found to lines, false if the block
+	// was rejected by its name mapping
+	bool search(BlockDecoder &blk, const Block &block, std::string &lines, size_t &found);
+	void report(bool searched, const std::string &lines, size_t found);
+
+	std::ostream &m_out;
+	std::set<std::string> m_names;
+	int m_xMin, m_xMax, m_zMin, m_zMax, m_yMin, m_yMax;
+	size_t m_blocksSearched;
+	size_t m_blocksRejected;
+	size_t m_nodesFound;
+
+#if __cplusplus >= 201103L
+	void run();
+
+	std::mutex m_mutex;
+	std::condition_variable m_queued; // a block was queued, or m_stop set
+	std::condition_variable m_done; // a block was taken or searched
+	std::deque<Block> m_blocks;
+	size_t m_busy; // blocks taken but not searched yet
+	bool m_stop;
+	std::string m_error;
+	std::vector<std::thread> m_threads;
+#else
+	BlockDecoder m_blk;
+#endif
+};
+
+#endif // NODEFINDER_HEADER
@@ -0,0 +1,49 @@
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * PNG encoder for gd truecolor pixels (0xAARRGGBB with gd's 7 bit alpha,
+ * 0 is opaque). Images without transparency are written as palette or RGB
+ * images, and the compressed data is split into pieces that are deflated on
+ * all cores.
+ */
+class PngWriter {
+public:
+	enum Preset {
+		FAST,
+		DEFAULT,
+		SMALL,
+	};
+
+	// How opaque images are reduced to 8 bit palette images. Images with
+	// transparent pixels are always written as RGBA.
+	enum PaletteMode {
+		EXACT, // only if they have at most 256 colors, RGB otherwise
+		PER_IMAGE, // to the 256 colors that fit the image best
+		SHARED, // to the nearest colors of a palette shared by all images
+	};
+
+	struct Options {
+		Options(): preset(DEFAULT), palette(EXACT) {}
+
+		Preset preset;
+		PaletteMode palette;
+		std::vector<int> sharedPalette; // gd colors, at most 256
+	};
+
+	static void write(const std::string &fileName, const int *const *rows,
+		int width, int height, const Options &options = Options());
+	static void write(std::ostream &out, const int *const *rows,
+		int width, int height, const Options &options = Options());
+
+	// Median cut: reduces weighted gd colors to at most maxColors
+	static std::vector<int> reduceColors(std::vector<std::pair<int, unsigned long> > colors,
+		size_t maxColors);
+};
+
+#endif // PNGWRITER_H
@@ -0,0 +1,106 @@
+#ifndef PYRAMID_HEADER
+#define PYRAMID_HEADER
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Image.h"
+
+/*
+ * Zoomed out levels above a grid of tiles, as Leaflet loads them. The four
+ * quadrants around tile 0,0 are covered by 2^maxLevel by 2^maxLevel tiles
+ * each. Level 0 is one tile per quadrant, the tiles themselves are copied
+ * to level maxLevel.
+ */
+
+// A pyramid tile as Leaflet addresses it, y grows downwards
+struct TileKey {
+	TileKey(): level(0), x(0), y(0) {}
+	TileKey(int level, int x, int y): level(level), x(x), y(y) {}
+	int level, x, y;
+};
+
+// maxLevel for the grid described by a metadata file
+int pyramidMaxLevel(int numTilesX, int numTilesY, int minTileX, int minTileY);
+
+// File of the pyramid tile covering the divisor by divisor tiles from
+// minTileX, minTileY on level
+std::string pyramidTileName(std::string const &out, int level, int minTileX, int minTileY,
+	int divisor, bool leafletMode);
+std::string pyramidTileName(std::string const &out, const TileKey &key);
+// Key of the same tile, tiles themselves are on level maxLevel with divisor 1
+TileKey pyramidTileKey(int level, int minTileX, int minTileY, int divisor);
+
+// File of a tile in a layout like {z}/{x}/{y}.png, which is Leaflet's URL
+// template for it too. false if {z}, {x} or {y} is missing.
+bool validTileLayout(std::string const &layout);
+std::string layoutTileName(std::string const &layout, const TileKey &key);
+
+// Writes <output>.html showing the pyramid, with Leaflet's URL template
+// for the tiles, and the markers in markerDir if there is one
+void outputLeafletCode(std::string const &output, int maxLevel, int tileSize,
+	std::string const &tileUrl, std::string const &markerDir = "");
+// The tiles' URL template when they are files named as usual
+std::string defaultTileUrl(std::string const &output);
+
+// Writes <output>.tiles.js, which tells the page from outputLeafletCode()
+// which pyramid tiles there are above tiles, so it doesn't ask for the
+// others. Per level a bitmap over their bounding box, in base64.
+std::string tileIndexName(std::string const &output);
+void writeTileIndex(std::string const &output, int maxLevel, const std::vector<std::pair<int, int> > &tiles);
+
+// Markers as GeoJSON in dir, a file per tile on the bottom level named
+// <x>_<y>.json. <dir>/index.js lists them with the number of markers.
+std::string markerIndexName(std::string const &dir);
+std::string markerChunkName(std::string const &dir, const TileKey &key);
+void writeMarkerIndex(std::string const &dir, int level, const std::map<std::pair<int, int>, int> &chunks);
+
+// Sorted list of the tiles minetestmapper wrote for baseName, so that
+// buildpyramid doesn't have to look for them
+std::string tileListName(std::string const &baseName);
+void writeTileList(std::string const &fileName, std::vector<std::pair<int, int> > tiles);
+// false if there is no complete list
+bool readTileList(std::string const &fileName, std::vector<std::pair<int, int> > &tiles);
+
+/*
+ * Builds the pyramid while the tiles are rendered: every tile is scaled
+ * into its parent right away, and a parent is done as soon as all tiles
+ * below it were added. Only the unfinished parents are kept.
+ */
+class PyramidBuilder
+{
+public:
+	// Done pyramid tiles, the images are owned by the caller
+	typedef std::vector<std::pair<TileKey, Image *> > Finished;
+
+	// tiles lists every tile that will be added
+	PyramidBuilder(int tileSize, int maxLevel,
+		const std::vector<std::pair<int, int> > &tiles);
+	~PyramidBuilder();
+
+	void addTile(int tileX, int tileY, Image &tile, Finished &finished);
+	// Whatever is still unfinished, when fewer tiles were added than listed
+	void finish(Finished &finished);
+
+private:
+	struct Node {
+		Node(): image(NULL), added(0), expected(0) {}
+		Image *image;
+		int added, expected; // tiles below
+	};
+	// by level and the minimum tile covered
+	typedef std::map<std::pair<int, std::pair<int, int> >, Node> NodeMap;
+
+	NodeMap::key_type key(int level, int tileX, int tileY) const;
+	Node &node(const NodeMap::key_type &k);
+	void complete(NodeMap::iterator it, Finished &finished);
+
+	int m_tileSize;
+	int m_maxLevel;
+	int m_maxDim;
+	NodeMap m_nodes;
+};
+
+#endif // PYRAMID_HEADER
@@ -0,0 +1,58 @@
+#ifndef SURFACECACHE_HEADER
+#define SURFACECACHE_HEADER
+
+#include <map>
+#include <string>
+#include <utility>
+#include <stdint.h>
+
+#include "Image.h"
+#include "types.h"
+
+/*
+ * On-disk cache of what renderMapBlock() found for a column of blocks:
+ * for every node column the color drawn, the height and the thickness.
+ * Entries carry a fingerprint of the blocks that were read to produce them.
+ */
+class SurfaceCache
+{
+public:
+	enum {
+		PIXEL_DRAWN = (1 << 0),
+		PIXEL_HEIGHT = (1 << 1),
+	};
+
+	struct Pixel {
+		Color color;
+		int height;
+		uint8_t thickness;
+		uint8_t flags;
+	};
+
+	struct Column {
+		uint64_t fingerprint; // of the blocks read from the top
+		uint16_t numBlocks; // how many blocks were read
+		bool covered; // reading stopped because every pixel was drawn
+		Pixel pixels[16][16]; // [z][x]
+	};
+
+	SurfaceCache();
+	bool load(const std::string &fileName, uint64_t settings);
+	void save(const std::string &fileName, uint64_t settings) const;
+	bool has(int16_t x, int16_t z) const;
+	bool get(int16_t x, int16_t z, Column &column) const;
+	void put(int16_t x, int16_t z, const Column &column);
+
+private:
+	struct Entry {
+		uint64_t fingerprint;
+		uint16_t numBlocks;
+		bool covered;
+		ustring pixels; // compressed
+	};
+	typedef std::map<std::pair<int16_t, int16_t>, Entry> ColumnMap;
+
+	ColumnMap m_columns;
+};
+
+#endif // SURFACECACHE_HEADER
@@ -0,0 +1,68 @@
+#ifndef TILECONTAINER_HEADER
+#define TILECONTAINER_HEADER
+
+#include <sqlite3.h>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <mutex>
+#endif
+
+#include "Pyramid.h"
+
+/*
+ * Tiles and pyramid tiles in one SQLite file instead of a file each, laid
+ * out like a deduplicating MBTiles file: the map table points to images by
+ * the hash of their PNG data, so identical tiles are stored once, and the
+ * tiles view joins them. Unlike MBTiles, tile_row is Leaflet's y. Tiles are
+ * on level maxLevel, the pyramid above them. Changes are written in one
+ * transaction, on commit() or when the container is closed. Every method
+ * may be called from any thread.
+ */
+class TileContainer
+{
+public:
+	TileContainer(const std::string &fileName, bool readOnly = false);
+	~TileContainer();
+
+	void put(const TileKey &key, const std::string &png);
+	// Make key show the image target shows
+	void link(const TileKey &target, const TileKey &key);
+	// false if there is no tile at key
+	bool get(const TileKey &key, std::string &png);
+	bool contains(const TileKey &key);
+	// Identifies the image at key, equal images have equal ids
+	bool imageId(const TileKey &key, int64_t &id);
+	void remove(const TileKey &key);
+	// x and y of every tile on level, with their image ids
+	std::vector<std::pair<std::pair<int, int>, int64_t> > tiles(int level);
+	void setMetadata(const std::string &name, const std::string &value);
+	void commit();
+
+private:
+	TileContainer(const TileContainer &);
+	int64_t storeImage(const std::string &png);
+	bool find(const TileKey &key, int64_t &id);
+	void setTile(const TileKey &key, int64_t id);
+	void step(sqlite3_stmt *stmt);
+
+	sqlite3 *db;
+	bool m_readOnly;
+	bool m_dropped; // map rows were replaced or removed since the last commit
+
+	sqlite3_stmt *stmt_find_tile;
+	sqlite3_stmt *stmt_set_tile;
+	sqlite3_stmt *stmt_remove_tile;
+	sqlite3_stmt *stmt_get_image;
+	sqlite3_stmt *stmt_put_image;
+	sqlite3_stmt *stmt_list_tiles;
+	sqlite3_stmt *stmt_set_metadata;
+
+#if __cplusplus >= 201103L
+	std::mutex m_mutex;
+#endif
+};
+
+#endif // TILECONTAINER_HEADER
@@ -3,6 +3,7 @@
 
 #include <iosfwd>
 #include <list>
+#include <map>
 #include <config.h>
 #if __cplusplus >= 201103L
 #include <unordered_map>
@@ -13,8 +14,12 @@
 #endif
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 #include "PixelAttributes.h"
+#include "Pyramid.h"
+#include "SurfaceCache.h"
+#include "TileWriter.h"
 #include "BlockDecoder.h"
 #include "Image.h"
 #include "db.h"
@@ -56,7 +61,26 @@ struct BitmapThing { // 16x16 bitmap
 	uint16_t val[16];
 };
 
+struct DecodedBlock { // visible nodes of one block, top down for each node column
+	struct Node {
+		int y;
+		ColorEntry color;
+	};
+	uint16_t begin[16 * 16 + 1]; // into nodes, for the column at z * 16 + x
+	std::vector<Node> nodes;
+	// What it was decoded from, a matching hash alone doesn't make it the same block
+	ustring data;
+	int minY, maxY;
+};
+
+struct ScanPixel { // highest visible node found by the full scan
+	ScanPixel(): height(0) {};
+	int16_t height;
+	Color color; // alpha is 0 until a node was found
+};
+
 typedef std::list<std::pair<int, int> > PositionsList;
+typedef std::map<std::pair<int, int>, uint64_t> FingerprintMap;
 
 
 class TileGenerator
@@ -66,11 +90,15 @@ private:
 	typedef std::unordered_map<std::string, ColorEntry> ColorMap;
 	typedef std::unordered_set<std::string> NameSet;
 	typedef std::unordered_map<int, PositionsList> TileMap;
+	typedef std::unordered_map<uint64_t, std::list<std::pair<uint64_t, DecodedBlock> >::iterator> DecodeMemoIndex;
 #else
 	typedef std::map<std::string, ColorEntry> ColorMap;
 	typedef std::set<std::string> NameSet;
 	typedef std::map<int, PositionsList> TileMap;
+	typedef std::map<uint64_t, std::list<std::pair<uint64_t, DecodedBlock> >::iterator> DecodeMemoIndex;
 #endif
+	typedef std::list<std::pair<uint64_t, DecodedBlock> > DecodeMemo;
+	typedef std::map<std::pair<int, int>, std::vector<ScanPixel> > ScanTiles;
 
 public:
 	TileGenerator();
@@ -91,32 +119,76 @@ public:
 	void parseColorsFile(const std::string &fileName);
 	void setBackend(std::string backend);
 	void generate(const std::string &input, const std::string &output);
+	void exportDump(const std::string &input, const std::string &fileName);
 	void printGeometry(const std::string &input);
+	// Print every node named by --marker, in all of the blocks, as JSON lines
+	void findNodes(const std::string &input);
 	void setZoom(int zoom);
 	void setScales(uint flags);
 	void setDontWriteEmpty(bool f);
+	void setIncremental(bool incremental);
+	void setSurfaceCache(const std::string &fileName);
+	void setTrustSurfaceCache(bool trust);
+	void setPrintStatistics(bool print);
+	void setFullScan(bool fullScan);
+	void setPngPreset(PngWriter::Preset preset);
+	void setPalette(PngWriter::PaletteMode palette);
+	void setUseGd(bool useGd);
+	void setDedup(bool dedup);
+	void setPyramid(const std::string &name);
+	void setContainer(bool container);
+	void setTileLayout(const std::string &layout);
 	void sortPositionsIntoTiles();
 	void addMarker(std::string marker);
+	void setMarkerDir(const std::string &dir);
 
 private:
+	class ScanVisitor;
+
 	void parseColorsStream(std::istream &in);
 	void openDb(const std::string &input);
 	void closeDatabase();
 	void loadBlocks();
 	void createImage();
 	void renderMap(PositionsList &positions);
+	void renderScan();
+	void scanBlock(BlockDecoder &blk, const BlockPos &pos, const ustring &data);
+	bool isRowCached(const PositionsList &positions, int zPos) const;
+	uint64_t columnFingerprint(const BlockList &blockStack, size_t numBlocks) const;
+	bool renderCachedColumn(const BlockList &blockStack, int xPos, int zPos, bool trusted);
+	uint64_t tileFingerprint(PositionsList &positions, uint64_t settings);
+	void hashBlockColumn(const BlockList &blockStack);
+	uint64_t settingsFingerprint() const;
+	uint64_t surfaceSettingsFingerprint() const;
+	uint64_t colorMapFingerprint() const;
+	std::vector<int> sharedPalette() const;
+	uint64_t playersFingerprint(const std::string &inputPath) const;
+	FingerprintMap readManifest(const std::string &fileName, uint64_t settings) const;
+	void writeManifest(const std::string &fileName, uint64_t settings, const FingerprintMap &tiles) const;
 	std::list<int> getZValueList(PositionsList &positions) const;
 	void renderMapBlock(const BlockDecoder &blk, const BlockPos &pos);
+	const DecodedBlock &decodeBlock(BlockDecoder &blk, const BlockPos &pos, const ustring &data);
+	void renderDecodedBlock(const DecodedBlock &decoded, const BlockPos &pos);
 	void renderMapBlockBottom(const BlockPos &pos);
+	void reportMarker(const BlockDecoder &blk, const BlockPos &pos, int x, int y, int z, const std::string &name);
+	void writeMarkerChunks();
 	void renderShading(int zPos);
 	void renderScale();
 	void renderOrigin();
 	void renderPlayers(const std::string &inputPath);
 	void writeImage(const std::string &output);
+	void writeTile(const std::string &fileName, const TileKey &key);
+	void linkTile(const std::string &target, const TileKey &targetKey,
+		const std::string &fileName, const TileKey &key);
+	bool tileExists(const std::string &fileName, const TileKey &key);
+	Image *loadTile(const std::string &fileName, const TileKey &key);
+	void writePyramidTiles(PyramidBuilder::Finished &tiles);
 	void printUnknown();
+	void printStatistics();
 	int getImageX(int val, bool absolute=false) const;
 	int getImageY(int val, bool absolute=false) const;
 	void setZoomed(int x, int y, Color color);
+	void recordSurface(int x, int z, Color color, uint8_t thickness);
 
 private:
 	Color m_bgColor;
@@ -129,11 +201,28 @@ private:
 	bool m_drawAlpha;
 	bool m_shading;
 	bool m_dontWriteEmpty;
+	bool m_incremental;
+	bool m_trustSurfaceCache;
+	bool m_printStatistics;
+	bool m_fullScan;
+	PngWriter::Options m_pngOptions;
+	bool m_useGd;
+	bool m_dedup;
+	std::string m_emptyTile;
+	TileKey m_emptyTileKey;
+	std::string m_pyramidName;
+	bool m_useContainer;
+	TileContainer *m_container;
+	std::string m_tileLayout;
+	std::string m_containerFile;
+	int m_tileLevel; // of the tiles in a container or layout, the pyramid is above them
+	std::string m_surfaceCacheFile;
 	std::string m_backend;
 	int m_xBorder, m_yBorder;
 
 	DB *m_db;
 	Image *m_image;
+	TileWriter m_writer;
 	PixelAttributes m_blockPixelAttributes;
 	int m_xMin;
 	int m_xMax;
@@ -166,9 +255,23 @@ private:
 #else
 	std::set<std::string> m_markers;
 #endif
+	std::string m_markerDir;
+	// GeoJSON features by tile and their number, until the tile is done
+	std::map<std::pair<int, int>, std::pair<int, std::string> > m_markerChunks;
+	std::map<std::pair<int, int>, int> m_markerIndex; // chunks written, by key
 
 	int m_zoom;
 	uint m_scales;
+
+	uint64_t m_fingerprint; // of the blocks fed to the tile being rendered
+	SurfaceCache m_surfaceCache;
+	SurfaceCache::Column m_surface; // of the block column being rendered
+	DecodeMemo m_decodeMemo; // most recently used first
+	DecodeMemoIndex m_decodeMemoIndex;
+	unsigned long m_blocksDecoded;
+	unsigned long m_blocksReused; // from m_decodeMemo
+	unsigned long m_blocksSkipped; // before decoding
+	ScanTiles m_scanTiles; // of SCAN_TILE_SIZE block columns square, while scanning
 }; // class TileGenerator
 
 #endif // TILEGENERATOR_HEADER
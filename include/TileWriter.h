@@ -0,0 +1,96 @@
+#ifndef TILEWRITER_HEADER
+#define TILEWRITER_HEADER
+
+#include <deque>
+#include <map>
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+#if __cplusplus >= 201103L
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#include "Image.h"
+#include "TileContainer.h"
+
+/*
+ * Saves images on background threads, so rendering can go on with the next
+ * tile. Files are written under a temporary name and renamed into place, so
+ * readers never see half written images. Missing directories are created.
+ * Images written by key go to the container instead. Without C++11 images
+ * are saved right away.
+ */
+class TileWriter
+{
+public:
+	TileWriter();
+	~TileWriter();
+
+	// Save identical images only once, the repeats become hard links to
+	// the first file (or copies where that fails) on flush()
+	void setDedup(bool dedup);
+	// Where images written by key go, not owned
+	void setContainer(TileContainer *container);
+	// Takes ownership of image, blocks while the queue is full
+	void write(Image *image, const std::string &fileName,
+		const PngWriter::Options &options, bool useGd);
+	void write(Image *image, const TileKey &key,
+		const PngWriter::Options &options, bool useGd);
+	// Make fileName the same file as target, which was passed to write()
+	void link(const std::string &target, const std::string &fileName);
+	void link(const TileKey &target, const TileKey &key);
+	// Wait for every queued image, throws the first error that occurred
+	void flush();
+	size_t linkedCount() const { return m_linkedCount; }
+
+private:
+	// A file, or the key in the container if fileName is empty
+	struct Target {
+		std::string fileName;
+		TileKey key;
+	};
+	struct Job {
+		Image *image;
+		Target target;
+		PngWriter::Options options;
+		bool useGd;
+	};
+	// Two hashes of the pixels with different seeds
+	typedef std::pair<uint64_t, uint64_t> Hash;
+	typedef std::map<Hash, Target> WrittenMap;
+
+	void queue(const Job &job);
+	// Whether image has the same pixels as the one written to target
+	bool isRepeat(const Image &image, const Hash &hash, const Target &target);
+	void waitForJobs();
+	void save(const Job &job);
+	static void linkFile(const std::string &target, const std::string &fileName);
+	void writeLinks();
+
+	bool m_dedup;
+	TileContainer *m_container;
+	WrittenMap m_written;
+	// Copies of the last images written, most recently repeated first, so
+	// that most repeats are compared without reading the target back
+	std::deque<std::pair<Hash, Image *> > m_kept;
+	std::vector<std::pair<Target, Target> > m_links; // target, link
+	size_t m_linkedCount;
+
+#if __cplusplus >= 201103L
+	void run();
+
+	std::mutex m_mutex;
+	std::condition_variable m_queued; // a job was queued, or m_stop set
+	std::condition_variable m_done; // a job was taken or finished
+	std::deque<Job> m_jobs;
+	size_t m_busy;
+	bool m_stop;
+	std::string m_error;
+	std::vector<std::thread> m_threads;
+#endif
+};
+
+#endif // TILEWRITER_HEADER
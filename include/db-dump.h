@@ -0,0 +1,32 @@
+#ifndef DB_DUMP_HEADER
+#define DB_DUMP_HEADER
+
+#include "db.h"
+
+/*
+ * Read-only map dump, laid out in the order the mapper reads blocks:
+ * by Z row, then X, then descending Y. The file is mmap()ed, so rows are
+ * read straight from the page cache without any random I/O.
+ */
+class DBDump : public DB {
+public:
+	DBDump(const std::string &mapdir);
+	virtual std::vector<BlockPos> getBlockPos();
+	virtual void getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos);
+	virtual void scanBlocks(BlockVisitor &visitor);
+	virtual ~DBDump();
+
+	// Write every block of source to fileName, in the format read above
+	static void write(DB &source, const std::string &fileName);
+private:
+	BlockPos entryPos(uint64_t i) const;
+	uint64_t entryOffset(uint64_t i) const;
+
+	const unsigned char *data;
+	size_t size;
+	const unsigned char *index;
+	uint64_t count;
+	uint64_t indexOffset;
+};
+
+#endif // DB_DUMP_HEADER
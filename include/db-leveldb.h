@@ -9,13 +9,17 @@ public:
 	DBLevelDB(const std::string &mapdir);
 	virtual std::vector<BlockPos> getBlockPos();
 	virtual void getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos);
+	virtual void scanBlocks(BlockVisitor &visitor);
 	virtual ~DBLevelDB();
 private:
 	void loadPosCache();
-
-	std::vector<BlockPos> posCache;
+	void scanKeys(leveldb::Iterator *it, bool negative, int digits,
+		int64_t absMin, int64_t absMax,
+		std::map<int16_t, BlockList> &blocks, int16_t zPos);
 
 	leveldb::DB *db;
+	const leveldb::Snapshot *snapshot;
+	leveldb::ReadOptions readOptions;
 };
 
 #endif // DB_LEVELDB_HEADER
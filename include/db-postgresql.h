@@ -2,6 +2,7 @@
 #define _DB_POSTGRESQL_H
 
 #include "db.h"
+#include <deque>
 #include <libpq-fe.h>
 
 class DBPostgreSQL : public DB {
@@ -9,21 +10,42 @@ public:
 	DBPostgreSQL(const std::string &mapdir);
 	virtual std::vector<BlockPos> getBlockPos();
 	virtual void getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos);
+	virtual void prefetchBlocksOnZ(const std::list<int> &zPositions);
+	virtual void scanBlocks(BlockVisitor &visitor);
 	virtual ~DBPostgreSQL();
 protected:
 	PGresult *checkResults(PGresult *res, bool clear = true);
-	void prepareStatement(const std::string &name, const std::string &sql);
+	PGconn *connectDb(const std::string &connect_string);
+	void prepareStatement(PGconn *conn, const std::string &name, const std::string &sql);
 	PGresult *execPrepared(
 		const char *stmtName, const int paramsNumber,
 		const void **params,
 		const int *paramsLengths = NULL, const int *paramsFormats = NULL,
 		bool clear = true, bool nobinary = true
 	);
+	void streamPrepared(
+		PGconn *conn, const char *stmtName, const int paramsNumber,
+		const void **params,
+		const int *paramsLengths = NULL, const int *paramsFormats = NULL,
+		bool nobinary = true
+	);
+	PGresult *streamNext(PGconn *conn);
 	int pg_to_int(PGresult *res, int row, int col);
 	int pg_binary_to_int(PGresult *res, int row, int col);
 	BlockPos pg_to_blockpos(PGresult *res, int row, int col);
+	BlockPos pg_binary_to_blockpos(PGresult *res, int row, int col);
 private:
+	void sendPending();
+	void sendBlocksOnZ(PGconn *conn, int16_t zPos);
+	void readBlocksOnZ(PGconn *conn, std::map<int16_t, BlockList> &blocks, int16_t zPos);
+
 	PGconn *db;
+
+	// prefetch connections sharing the snapshot of db
+	std::vector<PGconn *> pool;
+	std::vector<PGconn *> idle;
+	std::map<int16_t, PGconn *> inFlight;
+	std::deque<int16_t> pending;
 };
 
 #endif // _DB_POSTGRESQL_H
@@ -9,17 +9,18 @@ public:
 	DBRedis(const std::string &mapdir);
 	virtual std::vector<BlockPos> getBlockPos();
 	virtual void getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos);
+	virtual void scanBlocks(BlockVisitor &visitor);
 	virtual ~DBRedis();
 private:
 	static std::string replyTypeStr(int type);
 
 	void loadPosCache();
+	void loadPosCacheAtOnce();
 	void HMGET(const std::vector<BlockPos> &positions, std::vector<ustring> *result);
 
-	std::vector<BlockPos> posCache;
-
 	redisContext *ctx;
 	std::string hash;
+	std::size_t hmgetNumFields;
 };
 
 #endif // DB_REDIS_HEADER
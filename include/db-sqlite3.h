@@ -9,12 +9,14 @@ public:
 	DBSQLite3(const std::string &mapdir);
 	virtual std::vector<BlockPos> getBlockPos();
 	virtual void getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos);
+	virtual void scanBlocks(BlockVisitor &visitor);
 	virtual ~DBSQLite3();
 private:
 	sqlite3 *db;
 
 	sqlite3_stmt *stmt_get_block_pos;
 	sqlite3_stmt *stmt_get_blocks_z;
+	sqlite3_stmt *stmt_get_blocks;
 };
 
 #endif // _DB_SQLITE3_H
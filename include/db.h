@@ -46,13 +46,80 @@ protected:
 	inline int64_t  encodeBlockPos(const BlockPos pos) const;
 	inline BlockPos decodeBlockPos(int64_t hash) const;
 
+	// Z -> X -> Y index of the known block positions, for backends that
+	// can only look up blocks by their exact key
+	typedef std::map<int16_t, std::vector<int16_t> > PosIndexRow;
+	typedef std::map<int16_t, PosIndexRow> PosIndex;
+
+	inline void indexBlockPos(const BlockPos &pos);
+	inline void getIndexedPos(std::vector<BlockPos> &positions) const;
+	inline void getIndexedPosOnZ(std::vector<BlockPos> &positions, int16_t zPos) const;
+
+	PosIndex posIndex;
+
 public:
+	class BlockVisitor {
+	public:
+		virtual void visit(const BlockPos &pos, const ustring &data) = 0;
+		virtual ~BlockVisitor() {};
+	};
+
 	virtual std::vector<BlockPos> getBlockPos() = 0;
 	virtual void getBlocksOnZ(std::map<int16_t, BlockList> &blocks, int16_t zPos) = 0;
+	// Hint: these Z rows will be requested next, in this order
+	virtual void prefetchBlocksOnZ(const std::list<int> &/*zPositions*/) {}
+	// Visit every block at least once, in whatever order is cheapest
+	virtual void scanBlocks(BlockVisitor &visitor);
 	virtual ~DB() {};
 };
 
 
+inline void DB::scanBlocks(BlockVisitor &visitor)
+{
+	std::vector<BlockPos> positions = getBlockPos();
+	std::list<int> zPositions;
+	for (std::vector<BlockPos>::const_iterator it = positions.begin(); it != positions.end(); ++it)
+		zPositions.push_back(it->z);
+	zPositions.sort();
+	zPositions.unique();
+	prefetchBlocksOnZ(zPositions);
+
+	for (std::list<int>::const_iterator z = zPositions.begin(); z != zPositions.end(); ++z) {
+		std::map<int16_t, BlockList> blocks;
+		getBlocksOnZ(blocks, *z);
+		for (std::map<int16_t, BlockList>::const_iterator x = blocks.begin(); x != blocks.end(); ++x) {
+			for (BlockList::const_iterator block = x->second.begin(); block != x->second.end(); ++block)
+				visitor.visit(block->first, block->second);
+		}
+	}
+}
+
+
+
+inline void DB::indexBlockPos(const BlockPos &pos)
+{
+	posIndex[pos.z][pos.x].push_back(pos.y);
+}
+
+
+inline void DB::getIndexedPos(std::vector<BlockPos> &positions) const
+{
+	for (PosIndex::const_iterator z = posIndex.begin(); z != posIndex.end(); ++z)
+		getIndexedPosOnZ(positions, z->first);
+}
+
+
+inline void DB::getIndexedPosOnZ(std::vector<BlockPos> &positions, int16_t zPos) const
+{
+	PosIndex::const_iterator row = posIndex.find(zPos);
+	if (row == posIndex.end())
+		return;
+	for (PosIndexRow::const_iterator x = row->second.begin(); x != row->second.end(); ++x) {
+		for (std::vector<int16_t>::const_iterator y = x->second.begin(); y != x->second.end(); ++y)
+			positions.push_back(BlockPos(x->first, *y, zPos));
+	}
+}
+
 
 /****************
  * Black magic! *
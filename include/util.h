@@ -3,6 +3,7 @@
 
 #include <string>
 #include <fstream>
+#include <stdint.h>
 
 std::string read_setting(const std::string &name, std::istream &is);
 
@@ -15,4 +16,13 @@ inline std::string read_setting_default(const std::string &name, std::istream &i
 	}
 }
 
+// Fast non-cryptographic hash, chain calls by passing the previous result
+uint64_t hash_data(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL);
+
+// Creates the directories path is in, where they don't exist yet
+void create_parent_dirs(const std::string &path);
+
+// s quoted and escaped as a JSON string
+std::string json_string(const std::string &s);
+
 #endif // UTIL_H
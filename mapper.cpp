@@ -25,16 +25,30 @@ void usage()
 			"  --drawalpha\n"
 			"  --noshading\n"
 			"  --noemptyimage\n"
+			"  --incremental\n"
+			"  --surfacecache <file>\n"
+			"  --trustsurfacecache\n"
+			"  --stats\n"
+			"  --fullscan\n"
+			"  --pngpreset fast|default|small|gd\n"
+			"  --palette exact|tile|global\n"
+			"  --dedup\n"
+			"  --pyramid <name>\n"
+			"  --container\n"
+			"  --tilelayout <{z}/{x}/{y}.png>\n"
 			"  --min-y <y>\n"
 			"  --max-y <y>\n"
 			"  --backend <backend>\n"
 			"  --geometry x:y+w+h\n"
 			"  --tilesize wxh\n"
 			"  --extent\n"
+			"  --export-dump <file>\n"
 			"  --zoom <zoomlevel>\n"
 			"  --colors <colors.txt>\n"
 			"  --scales [t][b][l][r]\n"
 			"  --marker <string>\n"
+			"  --geojson <dir>\n"
+			"  --find\n"
 			"Color format: '#000000'\n";
 	std::cout << usage_text;
 }
@@ -86,6 +100,7 @@ int main(int argc, char *argv[])
 		{"geometry", required_argument, 0, 'g'},
 		{"tilesize", required_argument, 0, 't'},
 		{"extent", no_argument, 0, 'E'},
+		{"export-dump", required_argument, 0, 'D'},
 		{"min-y", required_argument, 0, 'a'},
 		{"max-y", required_argument, 0, 'c'},
 		{"zoom", required_argument, 0, 'z'},
@@ -93,6 +108,19 @@ int main(int argc, char *argv[])
 		{"scales", required_argument, 0, 'f'},
 		{"marker", required_argument, 0, 'm'},
 		{"noemptyimage", no_argument, 0, 'n'},
+		{"incremental", no_argument, 0, 'I'},
+		{"surfacecache", required_argument, 0, 'u'},
+		{"trustsurfacecache", no_argument, 0, 'T'},
+		{"stats", no_argument, 0, 'x'},
+		{"fullscan", no_argument, 0, 'F'},
+		{"pngpreset", required_argument, 0, 'G'},
+		{"palette", required_argument, 0, 'L'},
+		{"dedup", no_argument, 0, 'k'},
+		{"pyramid", required_argument, 0, 'y'},
+		{"container", no_argument, 0, 'B'},
+		{"tilelayout", required_argument, 0, 'Y'},
+		{"geojson", required_argument, 0, 'J'},
+		{"find", no_argument, 0, 'N'},
 		{0, 0, 0, 0}
 	};
 
@@ -102,6 +130,8 @@ int main(int argc, char *argv[])
 
 	TileGenerator generator;
 	bool onlyPrintExtent = false;
+	bool findNodes = false;
+	std::string exportDump;
 	while (1) {
 		int option_index;
 		int c = getopt_long(argc, argv, "hi:o:", long_options, &option_index);
@@ -146,6 +176,9 @@ int main(int argc, char *argv[])
 			case 'E':
 				onlyPrintExtent = true;
 				break;
+			case 'D':
+				exportDump = optarg;
+				break;
 			case 'H':
 				generator.setShading(false);
 				break;
@@ -219,12 +252,79 @@ int main(int argc, char *argv[])
 			case 'n':
 				generator.setDontWriteEmpty(true);
 				break;
+			case 'I':
+				generator.setIncremental(true);
+				break;
+			case 'u':
+				generator.setSurfaceCache(optarg);
+				break;
+			case 'T':
+				generator.setTrustSurfaceCache(true);
+				break;
+			case 'x':
+				generator.setPrintStatistics(true);
+				break;
+			case 'F':
+				generator.setFullScan(true);
+				break;
+			case 'G': {
+					std::string preset = optarg;
+					if (preset == "fast")
+						generator.setPngPreset(PngWriter::FAST);
+					else if (preset == "default")
+						generator.setPngPreset(PngWriter::DEFAULT);
+					else if (preset == "small")
+						generator.setPngPreset(PngWriter::SMALL);
+					else if (preset == "gd")
+						generator.setUseGd(true);
+					else {
+						usage();
+						exit(1);
+					}
+				}
+				break;
+			case 'k':
+				generator.setDedup(true);
+				break;
+			case 'y':
+				generator.setPyramid(optarg);
+				break;
+			case 'B':
+				generator.setContainer(true);
+				break;
+			case 'Y':
+				if (!validTileLayout(optarg)) {
+					usage();
+					exit(1);
+				}
+				generator.setTileLayout(optarg);
+				break;
+			case 'J':
+				generator.setMarkerDir(optarg);
+				break;
+			case 'N':
+				findNodes = true;
+				break;
+			case 'L': {
+					std::string palette = optarg;
+					if (palette == "exact")
+						generator.setPalette(PngWriter::EXACT);
+					else if (palette == "tile")
+						generator.setPalette(PngWriter::PER_IMAGE);
+					else if (palette == "global")
+						generator.setPalette(PngWriter::SHARED);
+					else {
+						usage();
+						exit(1);
+					}
+				}
+				break;
 			default:
 				exit(1);
 		}
 	}
 
-	if (input.empty() || (!onlyPrintExtent && output.empty())) {
+	if (input.empty() || (!onlyPrintExtent && !findNodes && exportDump.empty() && output.empty())) {
 		usage();
 		return 0;
 	}
@@ -236,6 +336,16 @@ int main(int argc, char *argv[])
 			return 0;
 		}
 
+		if (!exportDump.empty()) {
+			generator.exportDump(input, exportDump);
+			return 0;
+		}
+
+		if (findNodes) {
+			generator.findNodes(input);
+			return 0;
+		}
+
 		if(colors == "")
 			colors = search_colors(input);
 		generator.parseColorsFile(colors);
@@ -1,5 +1,11 @@
 #include <stdexcept>
 #include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <direct.h>
+#endif
 
 #include "util.h"
 
@@ -61,3 +67,84 @@ std::string read_setting(const std::string &name, std::istream &is)
 }
 
 #undef EOFCHECK
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t hash_data(const void *data, size_t size, uint64_t hash)
+{
+  // xxHash64 on one lane: every word is mixed on its own before it goes
+  // into the state, so differences in high bits can't cancel out
+  const uint64_t prime1 = 0x9e3779b185ebca87ULL;
+  const uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+  const uint64_t prime3 = 0x165667b19e3779f9ULL;
+  const uint64_t prime4 = 0x85ebca77c2b2ae63ULL;
+  const uint64_t prime5 = 0x27d4eb2f165667c5ULL;
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  hash += prime5 + size;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    hash ^= rotl64(word * prime2, 31) * prime1;
+    hash = rotl64(hash, 27) * prime1 + prime4;
+  }
+  if (size >= 4) {
+    uint32_t word;
+    memcpy(&word, p, 4);
+    hash ^= word * prime1;
+    hash = rotl64(hash, 23) * prime2 + prime3;
+    size -= 4;
+    p += 4;
+  }
+  for (; size > 0; --size, ++p) {
+    hash ^= *p * prime5;
+    hash = rotl64(hash, 11) * prime1;
+  }
+
+  hash ^= hash >> 33;
+  hash *= prime2;
+  hash ^= hash >> 29;
+  hash *= prime3;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+void create_parent_dirs(const std::string &path)
+{
+  std::string::size_type slash = path.find_last_of("/\\");
+  if (slash == std::string::npos || slash == 0)
+    return;
+  std::string dir = path.substr(0, slash);
+  // Usually the parent is there already, or just the directory itself is
+  // missing, so start at the bottom
+#ifdef _WIN32
+  if (_mkdir(dir.c_str()) == 0 || errno != ENOENT)
+    return;
+  create_parent_dirs(dir);
+  _mkdir(dir.c_str());
+#else
+  if (mkdir(dir.c_str(), 0777) == 0 || errno != ENOENT)
+    return;
+  create_parent_dirs(dir);
+  mkdir(dir.c_str(), 0777);
+#endif
+}
+
+std::string json_string(const std::string &s)
+{
+  std::ostringstream out;
+  out << '"';
+  for (size_t i = 0; i < s.size(); ++i) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\')
+      out << '\\' << c;
+    else if (c < 0x20)
+      out << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 15];
+    else
+      out << c;
+  }
+  out << '"';
+  return out.str();
+}
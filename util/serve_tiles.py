@@ -0,0 +1,50 @@
+#!/usr/bin/env python3
+# Serves the tiles of a minetestmapper --container file to Leaflet, as
+# tiles/{z}/{x}/{y}, and everything else from the current directory
+# (the .html written with --pyramid or by buildpyramid, leaflet.js, ...).
+# The container is only read, it can be updated while this runs.
+#
+# usage: serve_tiles.py <container> [port]
+
+import http.server
+import sqlite3
+import sys
+import threading
+
+
+class TileHandler(http.server.SimpleHTTPRequestHandler):
+	local = threading.local()
+
+	def tile(self, z, x, y):
+		if not hasattr(self.local, "db"):
+			self.local.db = sqlite3.connect("file:%s?mode=ro" % self.server.container, uri=True)
+		row = self.local.db.execute("SELECT tile_data FROM tiles WHERE zoom_level = ? AND "
+			"tile_column = ? AND tile_row = ?", (z, x, y)).fetchone()
+		return row[0] if row else None
+
+	def do_GET(self):
+		parts = self.path.split("?")[0].split("/")
+		if len(parts) != 5 or parts[1] != "tiles":
+			return super().do_GET()
+		try:
+			data = self.tile(int(parts[2]), int(parts[3]), int(parts[4]))
+		except ValueError:
+			data = None
+		if data is None:
+			self.send_error(404)
+			return
+		self.send_response(200)
+		self.send_header("Content-Type", "image/png")
+		self.send_header("Content-Length", str(len(data)))
+		self.end_headers()
+		self.wfile.write(data)
+
+
+if len(sys.argv) < 2:
+	print("usage: serve_tiles.py <container> [port]")
+	sys.exit(1)
+port = int(sys.argv[2]) if len(sys.argv) > 2 else 8000
+server = http.server.ThreadingHTTPServer(("", port), TileHandler)
+server.container = sys.argv[1]
+print("Serving %s on http://localhost:%d/" % (sys.argv[1], port))
+server.serve_forever()